@@ -0,0 +1,142 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "hl_pmr.hpp"
+
+/*
+ * Container churn through the C++ adapters in hl_pmr.hpp, against the
+ * default resource (operator new/delete, i.e. the system malloc).
+ *
+ *   gcc -O2 -c heaplib.c spinlock.c hl_profile.c
+ *   g++ -O2 -std=c++17 -o bench_pmr bench_pmr.cpp heaplib.o spinlock.o hl_profile.o -lpthread
+ *
+ *   vector  Builds vectors of random length by push_back (so they grow
+ *           through a series of reallocations) and drops them again.
+ *   map     Inserts into and erases from an unordered_map at random, keeping
+ *           it around KEYS / 2 entries (one node allocation per insert, plus
+ *           the bucket array growing).
+ *
+ * Each trace runs on the default resource, on an hl heap through
+ * hl::heap_resource, on a monotonic_buffer_resource whose upstream is the hl
+ * heap (nothing is freed until the trace ends), and on an hl heap through
+ * hl::heap_allocator.
+ */
+
+#define HEAP_SIZE (64u << 20)
+#define ROUNDS 2000
+#define MAX_LENGTH 2000
+#define KEYS 20000
+#define MAP_STEPS 2000000
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Vector, class Make>
+static double vector_churn(Make make)
+{
+    std::mt19937 rng(32);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Vector> live;
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        Vector v = make();
+        int length = rng() % MAX_LENGTH;
+        for (int j = 0; j < length; j++)
+        {
+            v.push_back(j);
+        }
+        live.push_back(std::move(v));
+        if (live.size() > 16)
+        {
+            live.erase(live.begin() + rng() % live.size());
+        }
+    }
+    live.clear();
+    return seconds_since(start);
+}
+
+template <class Map>
+static double map_churn(Map &m)
+{
+    std::mt19937 rng(32);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < MAP_STEPS; i++)
+    {
+        long key = rng() % KEYS;
+        if (rng() % 2)
+        {
+            m[key] = i;
+        }
+        else
+        {
+            m.erase(key);
+        }
+    }
+    m.clear();
+    return seconds_since(start);
+}
+
+static void report(const char *trace, const char *resource, double seconds)
+{
+    printf("%-7s %-20s %8.1f ms\n", trace, resource, seconds * 1000);
+}
+
+int main(void)
+{
+    char *heap = static_cast<char *>(malloc(HEAP_SIZE));
+    using pmr_vector = std::pmr::vector<long>;
+    using pmr_map = std::pmr::unordered_map<long, long>;
+
+    report("vector", "default", vector_churn<pmr_vector>([] { return pmr_vector(std::pmr::get_default_resource()); }));
+    {
+        hl_init(heap, HEAP_SIZE);
+        hl::heap_resource resource(heap);
+        report("vector", "heap_resource", vector_churn<pmr_vector>([&] { return pmr_vector(&resource); }));
+    }
+    {
+        hl_init(heap, HEAP_SIZE);
+        hl::heap_resource resource(heap);
+        std::pmr::monotonic_buffer_resource arena(1 << 20, &resource);
+        report("vector", "monotonic over hl", vector_churn<pmr_vector>([&] { return pmr_vector(&arena); }));
+    }
+    {
+        hl_init(heap, HEAP_SIZE);
+        using hl_vector = std::vector<long, hl::heap_allocator<long>>;
+        report("vector", "heap_allocator",
+               vector_churn<hl_vector>([&] { return hl_vector(hl::heap_allocator<long>(heap)); }));
+    }
+
+    {
+        pmr_map m(std::pmr::get_default_resource());
+        report("map", "default", map_churn(m));
+    }
+    {
+        hl_init(heap, HEAP_SIZE);
+        hl::heap_resource resource(heap);
+        pmr_map m(&resource);
+        report("map", "heap_resource", map_churn(m));
+    }
+    {
+        hl_init(heap, HEAP_SIZE);
+        hl::heap_resource resource(heap);
+        std::pmr::monotonic_buffer_resource arena(1 << 20, &resource);
+        pmr_map m(&arena);
+        report("map", "monotonic over hl", map_churn(m));
+    }
+    {
+        hl_init(heap, HEAP_SIZE);
+        using hl_map = std::unordered_map<long, long, std::hash<long>, std::equal_to<long>,
+                                          hl::heap_allocator<std::pair<const long, long>>>;
+        hl_map m(0, std::hash<long>(), std::equal_to<long>(),
+                 hl::heap_allocator<std::pair<const long, long>>(heap));
+        report("map", "heap_allocator", map_churn(m));
+    }
+    free(heap);
+    return 0;
+}
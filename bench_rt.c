@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "heaplib.h"
+#include "heaplib_ext.h"
+
+/*
+ * Latency benchmark for realtime heaps (hl_init_realtime) against plain
+ * heaps (hl_init).
+ *
+ *   gcc -O2 -o bench_rt bench_rt.c heaplib.c spinlock.c hl_profile.c -lpthread
+ *
+ * Each trace is run on heaps of growing size. A bounded allocator shows the
+ * same worst case whatever the heap size; the first-fit heap's worst case
+ * grows with the number of free blocks it has to walk past.
+ *
+ *   fragmented  The heap is filled up with 104 byte blocks and every other
+ *               one is released, leaving nothing but small holes. Each
+ *               timed step asks for 200 bytes (which cannot be served, the
+ *               worst case for a first-fit walk), then allocates and
+ *               releases 96 bytes.
+ *   churn       Random allocs, releases and resizes of 1 to 2000 bytes with
+ *               up to 1/8 of the heap live.
+ */
+
+#define SAMPLES 20000
+/* The first-fit heap takes milliseconds per step on the fragmented trace */
+#define FRAGMENTED_SAMPLES (SAMPLES / 10)
+
+typedef struct
+{
+    double p50;
+    double p999;
+    double max;
+} latency_t;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static latency_t summarize(long *ns, int n)
+{
+    qsort(ns, n, sizeof(long), compare_long);
+    return (latency_t){.p50 = ns[n / 2], .p999 = ns[n - 1 - n / 1000], .max = ns[n - 1]};
+}
+
+static void set_up(char *heap, unsigned int heap_size, int realtime)
+{
+    if (realtime)
+    {
+        hl_init_realtime(heap, heap_size);
+    }
+    else
+    {
+        hl_init(heap, heap_size);
+    }
+}
+
+static latency_t fragmented(char *heap, unsigned int heap_size, int realtime, long *ns)
+{
+    set_up(heap, heap_size, realtime);
+    int n = heap_size / 112;
+    void **blocks = calloc(n, sizeof(void *));
+    for (int i = 0; i < n; i++)
+    {
+        blocks[i] = hl_alloc(heap, 104);
+    }
+    for (int i = 0; i < n; i += 2)
+    {
+        hl_release(heap, blocks[i]);
+    }
+    for (int i = 0; i < FRAGMENTED_SAMPLES; i++)
+    {
+        long start = now_ns();
+        void *block = hl_alloc(heap, 200);
+        void *small = hl_alloc(heap, 96);
+        hl_release(heap, small);
+        ns[i] = now_ns() - start;
+        hl_release(heap, block);
+    }
+    free(blocks);
+    return summarize(ns, FRAGMENTED_SAMPLES);
+}
+
+static latency_t churn(char *heap, unsigned int heap_size, int realtime, long *ns)
+{
+    set_up(heap, heap_size, realtime);
+    int n = heap_size / 8 / 1000 + 1;
+    void **blocks = calloc(n, sizeof(void *));
+    srandom(31);
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        int slot = random() % n;
+        unsigned int size = random() % 2000 + 1;
+        long start = now_ns();
+        if (blocks[slot] == NULL)
+        {
+            blocks[slot] = hl_alloc(heap, size);
+        }
+        else if (random() % 2)
+        {
+            void *moved = hl_resize(heap, blocks[slot], size);
+            blocks[slot] = moved != NULL ? moved : blocks[slot];
+        }
+        else
+        {
+            hl_release(heap, blocks[slot]);
+            blocks[slot] = NULL;
+        }
+        ns[i] = now_ns() - start;
+    }
+    free(blocks);
+    return summarize(ns, SAMPLES);
+}
+
+int main(void)
+{
+    unsigned int sizes[] = {1 << 16, 1 << 20, 1 << 24};
+    const char *traces[] = {"fragmented", "churn"};
+    long *ns = malloc(SAMPLES * sizeof(long));
+    char *heap = malloc(1 << 24);
+
+    printf("%-11s %-9s %10s %10s %10s %10s\n", "trace", "heap", "mode", "p50 ns", "p99.9 ns", "max ns");
+    for (int t = 0; t < 2; t++)
+    {
+        for (int s = 0; s < 3; s++)
+        {
+            for (int realtime = 0; realtime <= 1; realtime++)
+            {
+                latency_t latency = t == 0 ? fragmented(heap, sizes[s], realtime, ns)
+                                           : churn(heap, sizes[s], realtime, ns);
+                printf("%-11s %-9u %10s %10.0f %10.0f %10.0f\n", traces[t], sizes[s],
+                       realtime ? "realtime" : "first-fit", latency.p50, latency.p999, latency.max);
+            }
+        }
+    }
+    free(heap);
+    free(ns);
+    return 0;
+}
@@ -1,161 +1,1049 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "heaplib.h"
+#include "heaplib_ext.h"
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
 #include "spinlock.h"
+#include "hl_profile.h"
 
-/* 
- * Global lock object.  You should use this global lock for any locking you need to do.
+/* The profiler hooks are weak, so heaplib.c links without hl_profile.c;
+nothing is ever sampled then. */
+#pragma weak hl_profile_sample
+#pragma weak hl_profile_forget
+
+/*
+ * Locking.  There is no global malloc_lock any more; every heap carries its
+ * own locks in its heap header so that unrelated heaps never contend:
+ *
+ *   class_locks[i]  guards the free lists of the size classes striped onto
+ *                   it (see class_lock): classes i, i + NUM_CLASS_LOCKS, ...
+ *                   Blocks of up to MAX_CLASS_BLOCK_SIZE bytes are freed onto
+ *                   and allocated from these lists without touching any other
+ *                   lock, so threads working on different sizes do not
+ *                   serialize. Neighbouring classes use different locks.
+ *   heap_lock       guards the heap's free list and every split and
+ *                   coalesce, i.e. anything that changes a block's size.
+ *
+ * Lock ordering: class locks in ascending index order, then heap_lock.  A
+ * thread holding heap_lock never takes a class lock, and no thread holds two
+ * class locks except through lock_all_classes.  hl_consolidate takes
+ * all of them (lock_all_classes) to rebuild the lists.
+ *
+ * Shared heaps (hl_init_shared) use robust locks: if a process dies holding
+ * one, the next process to take it marks the heap broken (its lists may be
+ * half updated) and from then on every lock_heap on it fails, so the other
+ * processes get errors instead of a deadlock.
  */
-#ifdef __riscv
-volatile lock_t malloc_lock = {.riscv_lock = 0};
-#else
-volatile lock_t malloc_lock = {.pthread_lock = PTHREAD_MUTEX_INITIALIZER};
-#endif
 
 /* Useful shorthand: casts a pointer to a (char *) before adding */
 #define ADD_BYTES(base_addr, num_bytes) (((char *)(base_addr)) + (num_bytes))
 
+/* Blocks of these sizes (header included) are kept on per size class lists
+and are never split or coalesced. Class i holds blocks of 16 + 8 * i bytes,
+so requests of up to 248 bytes have a class. The classes share
+NUM_CLASS_LOCKS locks (see class_lock): a pthread mutex is 40 bytes of every
+heap header, and one per class would leave a MIN_HEAP_SIZE heap almost no
+room for blocks. */
+#define NUM_SIZE_CLASSES 31
+#define NUM_CLASS_LOCKS 4
+#define MIN_BLOCK_SIZE 16
+#define MAX_CLASS_BLOCK_SIZE (MIN_BLOCK_SIZE + 8 * (NUM_SIZE_CLASSES - 1))
+
+/* A block on the heap's free list needs room for its header, the list links
+and a footer holding its size (for coalescing with the block after it). */
+#define MIN_FREE_BLOCK_SIZE 24
+
+/* In HL_COALESCE_DEFERRED mode the heap is consolidated once this fraction
+of it has been released without merging. */
+#define CONSOLIDATE_FRACTION 4
+
+/* Heaps set up with hl_init_realtime keep their free blocks in a two-level
+segregated fit (TLSF) index instead of one first-fit list: the first level
+splits sizes by power of two, the second splits each power of two into
+SL_COUNT lists, and a bitmap per level records which lists are non-empty,
+so finding a fitting list is two find-first-set bit scans. Blocks smaller
+than SMALL_FREE_SIZE go to first level 0, one list per 8 byte size. */
+#define SL_COUNT_LOG2 3
+#define SL_COUNT (1 << SL_COUNT_LOG2)
+#define FL_SHIFT (SL_COUNT_LOG2 + 3)
+#define SMALL_FREE_SIZE (1u << FL_SHIFT)
+
+/* Written last by hl_init, so a heap image that was never fully set up (or
+was laid out by a different version of this file) fails hl_attach. */
+#define HEAP_MAGIC 0x484c4802u
+
+/* Values of block_header_t.in_use */
+#define BLOCK_FREE 0   /* on the heap free list (heap_lock) */
+#define BLOCK_IN_USE 1 /* handed out to the user */
+#define BLOCK_BINNED 2 /* on a size class list (class_locks) */
+#define BLOCK_STATE_MASK 0xff
+/* Flag on a BLOCK_IN_USE block: hl_profile is tracking it. */
+#define BLOCK_SAMPLED 0x100
+
+/* Sizes are multiples of 8, so the low bits of block_size_t are spare.
+PREV_FREE is set when the block physically before this one is BLOCK_FREE. */
+#define PREV_FREE 1u
+#define SIZE_MASK (~7u)
+
 typedef struct _block_header_t
 {
     unsigned int block_size_t;
     unsigned int in_use;
 } block_header_t;
 
+/* Stored in the payload of BLOCK_FREE and BLOCK_BINNED blocks. Links are
+offsets from the heap header (0 means none), never absolute pointers. */
+typedef struct _free_links_t
+{
+    unsigned int next;
+    unsigned int prev;
+} free_links_t;
+
+/* Holds offsets and sizes only, so a heap image stays valid when it is mapped
+at a different address (see hl_attach). */
 typedef struct _heap_header_t
 {
-    unsigned int size;
+    unsigned int magic;       /* HEAP_MAGIC once the heap is set up */
+    unsigned int root;        /* offset of the root block, 0 if none */
+    unsigned int size;        /* bytes from the heap header to the end of the heap */
+    unsigned int first_block; /* offset of the first block header */
+    unsigned int free_list;   /* offset of the first BLOCK_FREE block */
+    unsigned int free_bytes;  /* total size of the BLOCK_FREE blocks (heap_lock) */
+    unsigned int class_list[NUM_SIZE_CLASSES];
+    unsigned int coalesce_mode;  /* HL_COALESCE_* */
+    unsigned int deferred_bytes; /* released unmerged onto the free list since the last consolidation */
+    unsigned int class_released[NUM_CLASS_LOCKS]; /* released onto the class lists of each lock since then */
+    unsigned int pshared;        /* locks work across processes (hl_init_shared) */
+    unsigned int broken;         /* a process died holding a lock (see lock_heap) */
+    unsigned int tlsf_index;     /* offset of the TLSF index (hl_init_realtime), 0 if none */
+    lock_t heap_lock;
+    lock_t class_locks[NUM_CLASS_LOCKS];
 } heap_header_t;
 
-/* (HELPER FUNCTION:) Given a pointer to the heap, returns a pointer to the 
-first BLOCK header in the heap. (Takes into account heap alignment issues
-so blocks will always be 8 byte aligned, assumes the heap header is 8 bytes.) */
-void *get_first_block_head(void *heap)
+/* The TLSF index sits between the heap header and the first block. It is
+followed by fl_count * SL_COUNT list heads (offsets, 0 for an empty list). */
+typedef struct _tlsf_index_t
+{
+    unsigned int fl_count;
+    unsigned int fl_bitmap;
+    unsigned int sl_bitmap[];
+} tlsf_index_t;
+
+/* Bytes the calling thread may still allocate before hl_profile_sample is
+called (see hl_profile.h). */
+__thread long hl_profile_countdown = 0;
+
+/* Set by hl_set_pressure_handler. Process-wide: a function pointer cannot
+live in the heap header, which may be mapped by other processes. */
+static hl_pressure_handler_t pressure_handler = NULL;
+
+/* (HELPER FUNCTION:) Initializes a lock stored inside a heap. A pshared lock
+can be taken by every process that maps the heap, and is robust (see
+lock_heap). (The RISC-V spinlock is a plain word in the heap, so it works
+across processes either way, but it cannot tell that its holder died.) */
+void heap_lock_init(volatile lock_t *lock, int pshared)
+{
+#ifdef __riscv
+    (void)pshared;
+    lock->riscv_lock = 0;
+#else
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (pshared)
+    {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init((pthread_mutex_t *)&(lock->pthread_lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+#endif
+}
+
+/* (HELPER FUNCTION:) Initializes every lock of the heap. */
+void init_heap_locks(heap_header_t *header)
+{
+    heap_lock_init(&header->heap_lock, header->pshared);
+    for (int i = 0; i < NUM_CLASS_LOCKS; i++)
+    {
+        heap_lock_init(&header->class_locks[i], header->pshared);
+    }
+}
+
+/* (HELPER FUNCTION:) Takes one lock of the heap. Returns FAILURE, without
+holding it, if the heap is broken. Only shared heaps can break: when their
+robust lock reports that its holder died, the heap is marked broken and the
+lock made consistent, so that later callers fail here too rather than
+finding the lock unusable. */
+int lock_heap(heap_header_t *header, volatile lock_t *lock)
+{
+#ifndef __riscv
+    if (header->pshared)
+    {
+        pthread_mutex_t *mutex = (pthread_mutex_t *)&(lock->pthread_lock);
+        int error = pthread_mutex_lock(mutex);
+        if (error == EOWNERDEAD)
+        {
+            __atomic_store_n(&header->broken, 1, __ATOMIC_RELEASE);
+            pthread_mutex_consistent(mutex);
+        }
+        else if (error != 0)
+        {
+            __atomic_store_n(&header->broken, 1, __ATOMIC_RELEASE);
+            return FAILURE;
+        }
+        if (__atomic_load_n(&header->broken, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_unlock(mutex);
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+#endif
+    mutex_lock(lock);
+    return SUCCESS;
+}
+
+/* (HELPER FUNCTION:) Takes every lock of the heap in lock order. Returns
+FAILURE, holding none of them, if the heap is broken (see lock_heap). */
+int lock_all_classes(heap_header_t *header)
+{
+    for (int i = 0; i < NUM_CLASS_LOCKS; i++)
+    {
+        if (lock_heap(header, &header->class_locks[i]) != SUCCESS)
+        {
+            while (--i >= 0)
+            {
+                mutex_unlock(&header->class_locks[i]);
+            }
+            return FAILURE;
+        }
+    }
+    if (lock_heap(header, &header->heap_lock) != SUCCESS)
+    {
+        for (int i = NUM_CLASS_LOCKS - 1; i >= 0; i--)
+        {
+            mutex_unlock(&header->class_locks[i]);
+        }
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* (HELPER FUNCTION:) Releases the locks taken by lock_all_classes. */
+void unlock_all_classes(heap_header_t *header)
+{
+    mutex_unlock(&header->heap_lock);
+    for (int i = NUM_CLASS_LOCKS - 1; i >= 0; i--)
+    {
+        mutex_unlock(&header->class_locks[i]);
+    }
+}
+
+/* (HELPER FUNCTION:) Given a pointer to the heap, returns a pointer to the
+heap header. (Takes into account heap alignment issues so the header, and
+therefore every block, is 8 byte aligned.) */
+heap_header_t *get_heap_header(void *heap)
 {
     unsigned int heap_unaligned = 0;
     if ((unsigned long)heap % 8 != 0)
     {
         heap_unaligned = 8 - (unsigned long)heap % 8;
     }
-    heap_header_t *header = (heap_header_t *)heap;
-    return ADD_BYTES(header, heap_unaligned + 8);
+    return (heap_header_t *)ADD_BYTES(heap, heap_unaligned);
+}
+
+/* (HELPER FUNCTION:) Given a pointer to the heap, returns a pointer to the
+first BLOCK header in the heap. */
+void *get_first_block_head(void *heap)
+{
+    heap_header_t *header = get_heap_header(heap);
+    return ADD_BYTES(header, header->first_block);
 }
 
-/* (HELPER FUNCTION:) Given a pointer to the heap, returns a pointer to the 
-first end of the heap. (Takes into account heap alignment issues
-so blocks will always be 8 byte aligned.) */
+/* (HELPER FUNCTION:) Given a pointer to the heap, returns a pointer to the
+end of the heap. */
 void *end_of_heap(void *heap)
 {
-    heap_header_t *header = (heap_header_t *)heap;
+    heap_header_t *header = get_heap_header(heap);
     return ADD_BYTES(header, header->size);
 }
 
-/* (HELPER FUNCTION:) Given a pointer to the current block header, returns a 
-pointer to the next block header in the heap. (Assumes there is a next block 
+/* (HELPER FUNCTION:) Returns the size of a block, header included. The size
+word may be updated under heap_lock while the block's owner reads it, so it
+is always accessed atomically. */
+unsigned int get_block_size(block_header_t *block)
+{
+    return __atomic_load_n(&block->block_size_t, __ATOMIC_RELAXED) & SIZE_MASK;
+}
+
+/* (HELPER FUNCTION:) Sets the size of a block, keeping its PREV_FREE bit.
+(Must hold heap_lock.) */
+void set_block_size(block_header_t *block, unsigned int size)
+{
+    unsigned int flags = __atomic_load_n(&block->block_size_t, __ATOMIC_RELAXED) & PREV_FREE;
+    __atomic_store_n(&block->block_size_t, size | flags, __ATOMIC_RELAXED);
+}
+
+/* (HELPER FUNCTION:) Sets or clears the PREV_FREE bit of a block.
+(Must hold heap_lock.) */
+void set_prev_free(block_header_t *block, int prev_free)
+{
+    if (prev_free)
+    {
+        __atomic_fetch_or(&block->block_size_t, PREV_FREE, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_and(&block->block_size_t, ~PREV_FREE, __ATOMIC_RELAXED);
+    }
+}
+
+/* (HELPER FUNCTION:) Returns true if the block before this one is BLOCK_FREE. */
+int prev_is_free(block_header_t *block)
+{
+    return __atomic_load_n(&block->block_size_t, __ATOMIC_RELAXED) & PREV_FREE;
+}
+
+/* (HELPER FUNCTION:) Returns the BLOCK_* state of a block. */
+unsigned int get_block_state(block_header_t *block)
+{
+    return __atomic_load_n(&block->in_use, __ATOMIC_RELAXED) & BLOCK_STATE_MASK;
+}
+
+/* (HELPER FUNCTION:) Sets the BLOCK_* state of a block, clearing its flags. */
+void set_block_state(block_header_t *block, unsigned int state)
+{
+    __atomic_store_n(&block->in_use, state, __ATOMIC_RELAXED);
+}
+
+/* (HELPER FUNCTION:) Given a pointer to the current block header, returns a
+pointer to the next block header in the heap. (Assumes there is a next block
 header, may need to fix.) */
 void *get_next_block_head(void *block_head)
 {
     block_header_t *current = (block_header_t *)block_head;
-    return ADD_BYTES(current, current->block_size_t);
+    return ADD_BYTES(current, get_block_size(current));
+}
+
+/* (HELPER FUNCTION:) Converts a heap offset into a block header pointer. */
+block_header_t *block_at(heap_header_t *header, unsigned int offset)
+{
+    return offset == 0 ? NULL : (block_header_t *)ADD_BYTES(header, offset);
+}
+
+/* (HELPER FUNCTION:) Converts a block header pointer into a heap offset. */
+unsigned int offset_of(heap_header_t *header, block_header_t *block)
+{
+    return block == NULL ? 0 : (unsigned int)((char *)block - (char *)header);
+}
+
+/* (HELPER FUNCTION:) Returns true if a block header lies before the end of
+the heap, i.e. there really is a block there. */
+int before_end(heap_header_t *header, block_header_t *block)
+{
+    return (char *)block < ADD_BYTES(header, header->size);
+}
+
+/* (HELPER FUNCTION:) Returns the list links stored in a free block. */
+free_links_t *get_links(block_header_t *block)
+{
+    return (free_links_t *)ADD_BYTES(block, 8);
+}
+
+/* (HELPER FUNCTION:) Rounds a requested payload size up to a block size:
+8 byte header plus payload padded to a multiple of 8. Returns 0 if the
+request cannot be represented. */
+unsigned int padded_block_size(unsigned int block_size)
+{
+    if (block_size > UINT32_MAX - 16)
+    {
+        return 0;
+    }
+    unsigned int padding = (block_size % 8 == 0) ? 0 : 8 - (block_size % 8);
+    unsigned int size = block_size + padding + 8;
+    return size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size;
+}
+
+/* (HELPER FUNCTION:) Returns the size class of a block size, or -1 if the
+block is too large to be kept on a size class list. */
+int class_index(unsigned int size)
+{
+    if (size > MAX_CLASS_BLOCK_SIZE)
+    {
+        return -1;
+    }
+    return (size - MIN_BLOCK_SIZE) / 8;
+}
+
+/* (HELPER FUNCTION:) Returns the lock guarding the list of size class index.
+Classes are striped over the locks round robin, so sizes less than
+8 * NUM_CLASS_LOCKS bytes apart never share one. */
+volatile lock_t *class_lock(heap_header_t *header, int index)
+{
+    return &header->class_locks[index % NUM_CLASS_LOCKS];
+}
+
+/* (HELPER FUNCTION:) Returns the block size to use for a request on this
+heap. Realtime heaps coalesce every block, so no block may be smaller than a
+free block. */
+unsigned int block_size_for(heap_header_t *header, unsigned int block_size)
+{
+    unsigned int size = padded_block_size(block_size);
+    if (header->tlsf_index != 0 && size != 0 && size < MIN_FREE_BLOCK_SIZE)
+    {
+        size = MIN_FREE_BLOCK_SIZE;
+    }
+    return size;
+}
+
+/* (HELPER FUNCTION:) Returns the TLSF index of a heap, or NULL if the heap
+uses the plain free list. */
+tlsf_index_t *get_tlsf_index(heap_header_t *header)
+{
+    return header->tlsf_index == 0 ? NULL : (tlsf_index_t *)ADD_BYTES(header, header->tlsf_index);
 }
 
-/* (HELPER FUNCTION:) Given a pointer to a block and the heap, returns a 
-pointer to the desired block header. (Assumes the block header
-is 8 bytes and that the block is already in the heap.)*/
-void *find_block_head(void *heap, void *block)
+/* (HELPER FUNCTION:) Returns the list heads of a TLSF index. */
+unsigned int *tlsf_heads(tlsf_index_t *index)
 {
-    void *current = get_first_block_head(heap);
-    block_header_t *current_block_head = (block_header_t *)(current);
-    while (current < end_of_heap(heap))
+    return &index->sl_bitmap[index->fl_count];
+}
+
+/* (HELPER FUNCTION:) Returns the bytes taken by a TLSF index. */
+unsigned int tlsf_index_bytes(unsigned int fl_count)
+{
+    return sizeof(tlsf_index_t) + fl_count * (1 + SL_COUNT) * sizeof(unsigned int);
+}
+
+/* (HELPER FUNCTION:) Maps a block size to its first and second level list. */
+void tlsf_mapping(unsigned int size, unsigned int *fl, unsigned int *sl)
+{
+    if (size < SMALL_FREE_SIZE)
+    {
+        *fl = 0;
+        *sl = size / 8;
+        return;
+    }
+    unsigned int msb = 31 - __builtin_clz(size);
+    *fl = msb - FL_SHIFT + 1;
+    *sl = (size >> (msb - SL_COUNT_LOG2)) ^ SL_COUNT;
+}
+
+/* (HELPER FUNCTION:) Returns the head of the free list a free block of this
+size belongs on. */
+unsigned int *free_list_head(heap_header_t *header, unsigned int size)
+{
+    tlsf_index_t *index = get_tlsf_index(header);
+    if (index == NULL)
+    {
+        return &header->free_list;
+    }
+    unsigned int fl, sl;
+    tlsf_mapping(size, &fl, &sl);
+    return &tlsf_heads(index)[fl * SL_COUNT + sl];
+}
+
+/* (HELPER FUNCTION:) Brings the TLSF bitmaps up to date after the list for
+this size gained or lost a block. Does nothing for plain heaps. */
+void update_tlsf_bitmaps(heap_header_t *header, unsigned int size)
+{
+    tlsf_index_t *index = get_tlsf_index(header);
+    if (index == NULL)
+    {
+        return;
+    }
+    unsigned int fl, sl;
+    tlsf_mapping(size, &fl, &sl);
+    if (tlsf_heads(index)[fl * SL_COUNT + sl] != 0)
+    {
+        index->sl_bitmap[fl] |= 1u << sl;
+        index->fl_bitmap |= 1u << fl;
+    }
+    else
+    {
+        index->sl_bitmap[fl] &= ~(1u << sl);
+        if (index->sl_bitmap[fl] == 0)
+        {
+            index->fl_bitmap &= ~(1u << fl);
+        }
+    }
+}
+
+/* (HELPER FUNCTION:) Empties every free list of the heap. */
+void clear_free_lists(heap_header_t *header)
+{
+    header->free_list = 0;
+    __atomic_store_n(&header->free_bytes, 0, __ATOMIC_RELAXED);
+    tlsf_index_t *index = get_tlsf_index(header);
+    if (index != NULL)
+    {
+        memset(index->sl_bitmap, 0, tlsf_index_bytes(index->fl_count) - sizeof(tlsf_index_t));
+        index->fl_bitmap = 0;
+    }
+}
+
+/* (HELPER FUNCTION:) Removes a block from the heap free list.
+(Must hold heap_lock.) */
+void free_list_remove(heap_header_t *header, block_header_t *block)
+{
+    free_links_t *links = get_links(block);
+    unsigned int size = get_block_size(block);
+    unsigned int *head = free_list_head(header, size);
+    if (links->prev != 0)
+    {
+        get_links(block_at(header, links->prev))->next = links->next;
+    }
+    else
+    {
+        *head = links->next;
+    }
+    if (links->next != 0)
+    {
+        get_links(block_at(header, links->next))->prev = links->prev;
+    }
+    update_tlsf_bitmaps(header, size);
+    __atomic_store_n(&header->free_bytes, header->free_bytes - size, __ATOMIC_RELAXED);
+}
+
+/* (HELPER FUNCTION:) Finds a free block of at least size bytes without
+taking it off its list, or returns NULL. Plain heaps walk their free list
+(first fit). TLSF heaps round the request up to the next list boundary, so
+that any block on the list found is big enough, and find that list with two
+bit scans: no loop at all. If that finds nothing, the first block on the
+request's own list may still be big enough, so it is checked as well,
+unless the request is past the last list (no block can be that big then).
+(Must hold heap_lock.) */
+block_header_t *find_free_block(heap_header_t *header, unsigned int size)
+{
+    tlsf_index_t *index = get_tlsf_index(header);
+    if (index == NULL)
+    {
+        block_header_t *current = block_at(header, header->free_list);
+        while (current != NULL && get_block_size(current) < size)
+        {
+            current = block_at(header, get_links(current)->next);
+        }
+        return current;
+    }
+    unsigned int rounded = size;
+    if (size >= SMALL_FREE_SIZE)
+    {
+        unsigned int round = (1u << (31 - __builtin_clz(size) - SL_COUNT_LOG2)) - 1;
+        rounded = size > UINT32_MAX - round ? UINT32_MAX : size + round;
+    }
+    unsigned int fl, sl;
+    tlsf_mapping(rounded, &fl, &sl);
+    unsigned int sl_map = fl < index->fl_count ? index->sl_bitmap[fl] & (~0u << sl) : 0;
+    if (sl_map == 0)
+    {
+        unsigned int fl_map = fl + 1 < index->fl_count ? index->fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (fl_map != 0)
+        {
+            fl = __builtin_ctz(fl_map);
+            sl_map = index->sl_bitmap[fl];
+        }
+    }
+    if (sl_map != 0)
+    {
+        sl = __builtin_ctz(sl_map);
+        return block_at(header, tlsf_heads(index)[fl * SL_COUNT + sl]);
+    }
+    tlsf_mapping(size, &fl, &sl);
+    if (size > header->size || fl >= index->fl_count)
+    {
+        return NULL;
+    }
+    block_header_t *first = block_at(header, tlsf_heads(index)[fl * SL_COUNT + sl]);
+    return first != NULL && get_block_size(first) >= size ? first : NULL;
+}
+
+/* (HELPER FUNCTION:) Turns a block of the given size into a BLOCK_FREE block:
+writes its footer, marks the following block PREV_FREE and pushes it on the
+heap free list. Does not coalesce. (Must hold heap_lock.) */
+void make_free_block(heap_header_t *header, block_header_t *block, unsigned int size)
+{
+    set_block_size(block, size);
+    set_block_state(block, BLOCK_FREE);
+    *(unsigned int *)ADD_BYTES(block, size - 4) = size;
+    block_header_t *next = (block_header_t *)ADD_BYTES(block, size);
+    if (before_end(header, next))
+    {
+        set_prev_free(next, 1);
+    }
+    free_links_t *links = get_links(block);
+    unsigned int *head = free_list_head(header, size);
+    links->prev = 0;
+    links->next = *head;
+    if (*head != 0)
     {
-        current_block_head = (block_header_t *)current;
-        if (ADD_BYTES(current_block_head, 8) == block)
+        get_links(block_at(header, *head))->prev = offset_of(header, block);
+    }
+    *head = offset_of(header, block);
+    update_tlsf_bitmaps(header, size);
+    __atomic_store_n(&header->free_bytes, header->free_bytes + size, __ATOMIC_RELAXED);
+}
+
+/* (HELPER FUNCTION:) Returns a block to the heap free list, merging it with
+free neighbours on either side. (Must hold heap_lock.) */
+void coalesce_block(heap_header_t *header, block_header_t *block)
+{
+    unsigned int size = get_block_size(block);
+    block_header_t *next = (block_header_t *)ADD_BYTES(block, size);
+    if (before_end(header, next) && get_block_state(next) == BLOCK_FREE)
+    {
+        free_list_remove(header, next);
+        size += get_block_size(next);
+    }
+    if (prev_is_free(block))
+    {
+        unsigned int prev_size = *(unsigned int *)ADD_BYTES(block, -4);
+        block_header_t *prev = (block_header_t *)ADD_BYTES(block, -(long)prev_size);
+        free_list_remove(header, prev);
+        size += prev_size;
+        block = prev;
+    }
+    make_free_block(header, block, size);
+}
+
+/* (HELPER FUNCTION:) Takes a block of at least size bytes off the heap free
+list (see find_free_block), splitting off the rest if it is big enough to
+stand on its own. Returns NULL if no free block is large enough.
+(Must hold heap_lock.) */
+block_header_t *carve_block(heap_header_t *header, unsigned int size)
+{
+    block_header_t *current = find_free_block(header, size);
+    if (current == NULL)
+    {
+        return NULL;
+    }
+    free_list_remove(header, current);
+    unsigned int old_block_size = get_block_size(current);
+    if (old_block_size - size >= MIN_FREE_BLOCK_SIZE)
+    {
+        set_block_size(current, size);
+        block_header_t *new_free_block = (block_header_t *)ADD_BYTES(current, size);
+        __atomic_store_n(&new_free_block->block_size_t, 0, __ATOMIC_RELAXED);
+        make_free_block(header, new_free_block, old_block_size - size);
+    }
+    else
+    {
+        block_header_t *next = (block_header_t *)ADD_BYTES(current, old_block_size);
+        if (before_end(header, next))
+        {
+            set_prev_free(next, 0);
+        }
+    }
+    set_block_state(current, BLOCK_IN_USE);
+    return current;
+}
+
+/* (HELPER FUNCTION:) Ends a run of free blocks found by consolidate_heap:
+a run big enough to live on the heap free list becomes one BLOCK_FREE block,
+anything smaller (a lone minimum size block) goes back on its size class
+list. (Must hold every lock of the heap.) */
+void finish_free_run(heap_header_t *header, block_header_t *run, unsigned int run_size)
+{
+    if (run == NULL)
+    {
+        return;
+    }
+    if (run_size >= MIN_FREE_BLOCK_SIZE)
+    {
+        make_free_block(header, run, run_size);
+        return;
+    }
+    int index = class_index(run_size);
+    set_block_state(run, BLOCK_BINNED);
+    get_links(run)->next = header->class_list[index];
+    header->class_list[index] = offset_of(header, run);
+}
+
+/* (HELPER FUNCTION:) Rebuilds the heap free list and size class lists by
+walking every block and merging each run of adjacent BLOCK_FREE and
+BLOCK_BINNED blocks. (Must hold every lock of the heap.) */
+void consolidate_heap(heap_header_t *header)
+{
+    clear_free_lists(header);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        header->class_list[i] = 0;
+    }
+    block_header_t *run = NULL;
+    unsigned int run_size = 0;
+    block_header_t *current = block_at(header, header->first_block);
+    while (before_end(header, current))
+    {
+        unsigned int size = get_block_size(current);
+        if (get_block_state(current) == BLOCK_IN_USE)
+        {
+            set_prev_free(current, 0);
+            finish_free_run(header, run, run_size);
+            run = NULL;
+        }
+        else if (run == NULL)
+        {
+            set_prev_free(current, 0);
+            run = current;
+            run_size = size;
+        }
+        else
         {
-            return current_block_head;
+            run_size += size;
         }
-        current = get_next_block_head(current);
+        current = (block_header_t *)ADD_BYTES(current, size);
+    }
+    finish_free_run(header, run, run_size);
+    __atomic_store_n(&header->deferred_bytes, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < NUM_CLASS_LOCKS; i++)
+    {
+        __atomic_store_n(&header->class_released[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* (HELPER FUNCTION:) Returns the bytes released onto the size class lists
+since the last consolidation. */
+unsigned long class_released_bytes(heap_header_t *header)
+{
+    unsigned long bytes = 0;
+    for (int i = 0; i < NUM_CLASS_LOCKS; i++)
+    {
+        bytes += __atomic_load_n(&header->class_released[i], __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+/* (HELPER FUNCTION:) Returns the bytes released without merging since the
+last consolidation: onto the heap free list in deferred mode, and onto the
+size class lists. */
+unsigned long unmerged_bytes(heap_header_t *header)
+{
+    return __atomic_load_n(&header->deferred_bytes, __ATOMIC_RELAXED) + class_released_bytes(header);
+}
+
+/* (HELPER FUNCTION:) Returns true if consolidating the heap may make room
+for a block of size bytes: something must have been released unmerged since
+the last pass, and the free bytes it could merge with (on the heap free list
+and the size class lists) must add up to size. Read without locks, so it is
+an estimate. */
+int consolidation_may_help(heap_header_t *header, unsigned int size)
+{
+    unsigned long binned = class_released_bytes(header);
+    return (binned != 0 || __atomic_load_n(&header->deferred_bytes, __ATOMIC_RELAXED) != 0) &&
+           binned + __atomic_load_n(&header->free_bytes, __ATOMIC_RELAXED) >= size;
+}
+
+/* (HELPER FUNCTION:) Returns where the first block of a heap starts: right
+after the heap header, or after the TLSF index if the heap has one. */
+unsigned int first_block_offset(heap_header_t *header)
+{
+    unsigned int offset = (sizeof(heap_header_t) + 7) & SIZE_MASK;
+    if (header->tlsf_index != 0)
+    {
+        unsigned int fl, sl;
+        tlsf_mapping(header->size, &fl, &sl);
+        offset = (offset + tlsf_index_bytes(fl + 1) + 7) & SIZE_MASK;
+    }
+    return offset;
+}
+
+/* (HELPER FUNCTION:) Sets up a heap for hl_init, hl_init_shared and
+hl_init_realtime. The magic word is written last, so a heap being set up in
+shared memory is not attached to before it is complete. */
+int init_heap(void *heap, unsigned int heap_size, int pshared, int realtime)
+{
+    if (heap_size < MIN_HEAP_SIZE)
+    {
+        return FAILURE;
     }
-    return NULL;
+    heap_header_t *header = get_heap_header(heap);
+    unsigned int heap_unaligned = (unsigned int)((char *)header - (char *)heap);
+    header->magic = 0;
+    header->root = 0;
+    header->size = (heap_size - heap_unaligned) & SIZE_MASK;
+    header->tlsf_index = realtime ? (sizeof(heap_header_t) + 7) & SIZE_MASK : 0;
+    header->first_block = first_block_offset(header);
+    if (header->first_block + MIN_FREE_BLOCK_SIZE > header->size)
+    {
+        return FAILURE;
+    }
+    header->coalesce_mode = HL_COALESCE_EAGER;
+    header->deferred_bytes = 0;
+    header->pshared = pshared;
+    header->broken = 0;
+    init_heap_locks(header);
+    tlsf_index_t *index = get_tlsf_index(header);
+    if (index != NULL)
+    {
+        unsigned int fl, sl;
+        tlsf_mapping(header->size, &fl, &sl);
+        index->fl_count = fl + 1;
+    }
+    clear_free_lists(header);
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        header->class_list[i] = 0;
+    }
+    for (int i = 0; i < NUM_CLASS_LOCKS; i++)
+    {
+        header->class_released[i] = 0;
+    }
+    block_header_t *block = (block_header_t *)(get_first_block_head(heap));
+    block->block_size_t = 0;
+    make_free_block(header, block, header->size - header->first_block);
+    __atomic_store_n(&header->magic, HEAP_MAGIC, __ATOMIC_RELEASE);
+    return SUCCESS;
 }
 
 /* See the .h for the advertised behavior of this library function.
  * These comments describe the implementation, not the interface.
  *
- * Set up heap header to store overall data about the heap (size).
- * Allocate one large block equal to 8-byte aligned heap size and point
- * to the front of the block header. The block is set to be free (in_use = 0), 
- * because no memory has been allocated yet. 
- * 
- * 
+ * Set up the heap header (8-byte aligned) to store overall data about the
+ * heap: its size, the free lists and the locks. Everything after the header
+ * starts out as one large free block on the heap free list, because no
+ * memory has been allocated yet. The size class lists start empty.
  */
 int hl_init(void *heap, unsigned int heap_size)
 {
-    unsigned int heap_unaligned = 0;
-    if ((unsigned long)heap % 8 != 0)
+    return init_heap(heap, heap_size, 0, 0);
+}
+
+/* (HELPER FUNCTION:) Carves a block of at least size bytes off the heap
+free list. On a miss the heap is consolidated and carved again, but only if
+that may make room (see consolidation_may_help): on a heap that is simply
+full or fragmented the pass would walk every block, holding every lock of
+the heap, for nothing. Returns NULL if there is no block. */
+block_header_t *carve_or_consolidate(heap_header_t *header, unsigned int size)
+{
+    if (lock_heap(header, &header->heap_lock) != SUCCESS)
     {
-        heap_unaligned = 8 - (unsigned long)heap % 8;
+        return NULL;
     }
-    if (heap_size < MIN_HEAP_SIZE)
+    block_header_t *current_block = carve_block(header, size);
+    mutex_unlock(&header->heap_lock);
+    if (current_block == NULL && header->tlsf_index == 0 && consolidation_may_help(header, size) &&
+        lock_all_classes(header) == SUCCESS)
+    {
+        consolidate_heap(header);
+        current_block = carve_block(header, size);
+        unlock_all_classes(header);
+    }
+    return current_block;
+}
+
+/* (HELPER FUNCTION:) Finds a block of at least size bytes (a block size,
+header included) for hl_alloc: first on the size class list, then on the
+heap free list (consolidating if that may help, see carve_or_consolidate),
+and finally once more after the pressure handler (if any) freed something
+up. Returns NULL if there is none. */
+block_header_t *alloc_block(void *heap, unsigned int size)
+{
+    heap_header_t *header = get_heap_header(heap);
+    block_header_t *current_block = NULL;
+    int index = header->tlsf_index == 0 ? class_index(size) : -1;
+    if (index >= 0)
+    {
+        if (lock_heap(header, class_lock(header, index)) != SUCCESS)
+        {
+            return NULL;
+        }
+        current_block = block_at(header, header->class_list[index]);
+        if (current_block != NULL)
+        {
+            header->class_list[index] = get_links(current_block)->next;
+            set_block_state(current_block, BLOCK_IN_USE);
+        }
+        mutex_unlock(class_lock(header, index));
+    }
+    if (current_block == NULL)
+    {
+        current_block = carve_or_consolidate(header, size);
+    }
+    hl_pressure_handler_t handler = __atomic_load_n(&pressure_handler, __ATOMIC_ACQUIRE);
+    if (current_block == NULL && header->tlsf_index == 0 && handler != NULL && handler(heap))
+    {
+        current_block = carve_or_consolidate(header, size);
+    }
+    return current_block;
+}
+
+/* (HELPER FUNCTION:) Last step of every allocation: charges it against the
+thread's hl_profile countdown, hands the block to the profiler when the
+countdown runs out (flagging it BLOCK_SAMPLED if the profiler recorded it)
+and returns the payload. Without hl_profile.c linked in the countdown is
+simply pushed out of reach. Blocks of shared heaps are never sampled: the
+flag would be seen by every process, but only this one's profiler knows the
+block, so another process releasing it would make ours forget a block it
+still tracks at that address, or look up one it never had. */
+void *hand_out_block(heap_header_t *header, block_header_t *block, unsigned int size, unsigned int block_size)
+{
+    if (!header->pshared && (hl_profile_countdown -= size) < 0)
+    {
+        if (hl_profile_sample == NULL)
+        {
+            hl_profile_countdown = LONG_MAX;
+        }
+        else if (hl_profile_sample(ADD_BYTES(block, 8), block_size))
+        {
+            set_block_state(block, BLOCK_IN_USE | BLOCK_SAMPLED);
+        }
+    }
+    return (ADD_BYTES(block, 8));
+}
+
+/* (HELPER FUNCTION:) Shrinks an in-use block to size bytes, returning the
+rest to the heap free list if it is big enough to be a free block. */
+void trim_block(heap_header_t *header, block_header_t *block, unsigned int size)
+{
+    unsigned int old_size = get_block_size(block);
+    if (old_size - size < MIN_FREE_BLOCK_SIZE || lock_heap(header, &header->heap_lock) != SUCCESS)
+    {
+        return;
+    }
+    set_block_size(block, size);
+    block_header_t *new_free_block = (block_header_t *)(ADD_BYTES(block, size));
+    __atomic_store_n(&new_free_block->block_size_t, old_size - size, __ATOMIC_RELAXED);
+    set_block_state(new_free_block, BLOCK_IN_USE);
+    coalesce_block(header, new_free_block);
+    mutex_unlock(&header->heap_lock);
+}
+
+/* (HELPER FUNCTION:) Grows an in-use block in place to at least min_size
+and at most max_size bytes (block sizes, header included) by taking over the
+free blocks right after it. Returns FAILURE, leaving everything as it was,
+if that cannot reach min_size. Blocks on size class lists are not taken
+over: that would mean searching their lists. */
+int grow_block(heap_header_t *header, block_header_t *block, unsigned int min_size, unsigned int max_size)
+{
+    unsigned int old_size = get_block_size(block);
+    unsigned int size = old_size;
+    if (lock_heap(header, &header->heap_lock) != SUCCESS)
     {
         return FAILURE;
     }
-    heap_header_t *header = (heap_header_t *)heap;
-    header->size = heap_size;
-    block_header_t *block = (block_header_t *)(get_first_block_head(heap));
-    block->block_size_t = heap_size - heap_unaligned - 8;
-    block->in_use = 0;
+    block_header_t *next = (block_header_t *)ADD_BYTES(block, size);
+    while (size < max_size && before_end(header, next) && get_block_state(next) == BLOCK_FREE)
+    {
+        free_list_remove(header, next);
+        size += get_block_size(next);
+        next = (block_header_t *)ADD_BYTES(block, size);
+    }
+    if (size < min_size)
+    {
+        if (size > old_size)
+        {
+            make_free_block(header, (block_header_t *)ADD_BYTES(block, old_size), size - old_size);
+        }
+        mutex_unlock(&header->heap_lock);
+        return FAILURE;
+    }
+    set_block_size(block, size);
+    if (before_end(header, next))
+    {
+        set_prev_free(next, 0);
+    }
+    mutex_unlock(&header->heap_lock);
+    if (size > max_size)
+    {
+        trim_block(header, block, max_size);
+    }
     return SUCCESS;
 }
 
 /* See the .h for the advertised behavior of this library function.
  * These comments describe the implementation, not the interface.
  *
- * Start searching for a free block at the start of the heap. Stop searching
- * (1) If a large enough free block is found 
- *  or (2) If we get to the end of the heap.
- * 
- *  After finding a free block of large enough size, add in the padding and
- *  aligned size of the header to adjust the block size. If there is left over 
- *  space after allocating the block, then create a new free block next to 
- *  the allocated one. 
- * 
+ * Pad the request to an 8-byte aligned block size (header included).
+ *
+ * Realtime heaps skip the size class lists and never consolidate, so every
+ * path through them is a bounded number of steps (see find_free_block).
+ *
+ * Small blocks are first popped off their size class list, which only needs
+ * that class's lock. Otherwise (or if the list is empty) take heap_lock and
+ * carve a block from the heap free list, splitting off the left over space
+ * as a new free block. If that misses too and blocks released unmerged
+ * since the last consolidation (onto size class lists, or by deferred
+ * coalescing) may merge into a big enough block, consolidate the heap and
+ * try once more.
+ *
  *  (If there is no free block of a valid size found, then return FAILURE)
+ *
+ *  Every allocation (except on shared heaps) is charged against the thread's
+ *  hl_profile countdown; when it runs out the block is handed to the
+ *  profiler, and flagged BLOCK_SAMPLED if the profiler kept it.
  */
 void *hl_alloc(void *heap, unsigned int block_size)
 {
-    unsigned int padding = (block_size % 8 == 0) ? 0 : 8 - (block_size % 8);
-    void *current = get_first_block_head(heap);
-    block_header_t *current_block = (block_header_t *)(current);
-    while (current < end_of_heap(heap))
+    heap_header_t *header = get_heap_header(heap);
+    unsigned int size = block_size_for(header, block_size);
+    if (size == 0 || size > header->size)
+    {
+        return FAILURE;
+    }
+    block_header_t *current_block = alloc_block(heap, size);
+    if (current_block == NULL)
+    {
+        return FAILURE;
+    }
+    return hand_out_block(header, current_block, size, block_size);
+}
+
+/* (HELPER FUNCTION:) Puts an in-use block back: on its size class list if
+index (its class_index, -1 for none) says it has one, otherwise on the heap
+free list, merged with its neighbours unless the heap is in deferred mode.
+(Must hold the lock of that list: class_lock(header, index) or heap_lock.) */
+void release_block(heap_header_t *header, block_header_t *block, int index)
+{
+    if (index >= 0)
     {
-        current_block = (block_header_t *)current;
-        if (current_block->in_use == 0 && (current_block->block_size_t - 8 - padding >= block_size))
+        set_block_state(block, BLOCK_BINNED);
+        get_links(block)->next = header->class_list[index];
+        header->class_list[index] = offset_of(header, block);
+        unsigned int *counter = &header->class_released[index % NUM_CLASS_LOCKS];
+        unsigned int released = *counter;
+        if (released < header->size)
         {
-            current_block->in_use = 1;
-            unsigned int old_block_size = current_block->block_size_t;
-            current_block->block_size_t = block_size + padding + 8;
-            if (old_block_size >= current_block->block_size_t + 8)
-            {
-                block_header_t *new_free_block = (block_header_t *)(get_next_block_head(current));
-                new_free_block->in_use = 0;
-                new_free_block->block_size_t = old_block_size - current_block->block_size_t;
-            }
-            return (ADD_BYTES(current_block, 8));
+            __atomic_store_n(counter, released + get_block_size(block), __ATOMIC_RELAXED);
         }
-        current = get_next_block_head(current);
     }
-    return FAILURE;
+    else if (__atomic_load_n(&header->coalesce_mode, __ATOMIC_RELAXED) == HL_COALESCE_DEFERRED)
+    {
+        make_free_block(header, block, get_block_size(block));
+    }
+    else
+    {
+        coalesce_block(header, block);
+    }
+}
+
+/* (HELPER FUNCTION:) Counts bytes released onto the heap free list in
+deferred mode and consolidates the heap once a quarter of it has been
+released unmerged (see unmerged_bytes). (Must hold no locks.) */
+void charge_deferred_bytes(void *heap, unsigned int bytes)
+{
+    heap_header_t *header = get_heap_header(heap);
+    __atomic_add_fetch(&header->deferred_bytes, bytes, __ATOMIC_RELAXED);
+    if (unmerged_bytes(header) > header->size / CONSOLIDATE_FRACTION)
+    {
+        hl_consolidate(heap);
+    }
 }
 
 /* See the .h for the advertised behavior of this library function.
  * These comments describe the implementation, not the interface.
  *
- * Set in_use = 0 for the block given.
- * 
- * Then consider adding coalescing to prevent internal fragmentation.
+ * The block header sits right before the block, so no search is needed.
+ *
+ * Small blocks are pushed on their size class list under that class's lock
+ * and are not coalesced. Larger blocks go back on the heap free list under
+ * heap_lock, coalescing with free neighbours to limit fragmentation, unless
+ * the heap is in HL_COALESCE_DEFERRED mode: then they are pushed unmerged
+ * and the heap is consolidated once enough has been released that way.
+ * Realtime heaps always coalesce straight away.
  */
 void hl_release(void *heap, void *block)
 {
@@ -163,14 +1051,34 @@ void hl_release(void *heap, void *block)
     {
         return;
     }
-    block_header_t *block_head = (block_header_t *)(find_block_head(heap, block));
-    block_head->in_use = 0;
+    heap_header_t *header = get_heap_header(heap);
+    block_header_t *block_head = (block_header_t *)(ADD_BYTES(block, -8));
+    if (__atomic_load_n(&block_head->in_use, __ATOMIC_RELAXED) & BLOCK_SAMPLED)
+    {
+        hl_profile_forget(block);
+    }
+    unsigned int size = get_block_size(block_head);
+    int index = header->tlsf_index == 0 ? class_index(size) : -1;
+    volatile lock_t *lock = index >= 0 ? class_lock(header, index) : &header->heap_lock;
+    if (lock_heap(header, lock) != SUCCESS)
+    {
+        return;
+    }
+    release_block(header, block_head, index);
+    mutex_unlock(lock);
+    if (__atomic_load_n(&header->coalesce_mode, __ATOMIC_RELAXED) == HL_COALESCE_DEFERRED)
+    {
+        charge_deferred_bytes(heap, index >= 0 ? 0 : size);
+    }
 }
 
 /* See the .h for the advertised behavior of this library function.
  * These comments describe the implementation, not the interface.
  *
- * allocate, memmove, resize
+ * Shrinking happens in place; if enough is left over it is split off (under
+ * heap_lock) and returned to the heap free list. Growing also happens in
+ * place if the free blocks right after the block are big enough; otherwise
+ * allocate a new block, memmove the contents and release the old block.
  */
 void *hl_resize(void *heap, void *block, unsigned int new_size)
 {
@@ -178,19 +1086,21 @@ void *hl_resize(void *heap, void *block, unsigned int new_size)
     {
         return hl_alloc(heap, new_size);
     }
+    heap_header_t *header = get_heap_header(heap);
     block_header_t *old_block = (block_header_t *)(ADD_BYTES(block, -8));
-    unsigned int old_size = old_block->block_size_t;
-    unsigned int padding = (new_size % 8 == 0) ? 0 : 8 - (new_size % 8);
-    if (new_size + padding + 8 == old_size)
+    unsigned int old_size = get_block_size(old_block);
+    unsigned int size = block_size_for(header, new_size);
+    if (size == 0)
+    {
+        return FAILURE;
+    }
+    if (size <= old_size)
     {
+        trim_block(header, old_block, size);
         return block;
     }
-    else if (new_size + padding + 8 <= old_size - 8)
+    if (grow_block(header, old_block, size, size) == SUCCESS)
     {
-        old_block->block_size_t = new_size + padding + 8;
-        block_header_t *new_free_block = (block_header_t *)(get_next_block_head(block));
-        new_free_block->in_use = 0;
-        new_free_block->block_size_t = old_size - old_block->block_size_t;
         return block;
     }
     void *dest = hl_alloc(heap, new_size);
@@ -205,3 +1115,336 @@ void *hl_resize(void *heap, void *block, unsigned int new_size)
         return FAILURE;
     }
 }
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * The mode is a plain field of the heap header; hl_release reads it on
+ * every call. Leaving deferred mode merges whatever was left unmerged.
+ * Realtime heaps stay eager: deferred merging would bring back O(heap)
+ * consolidation passes.
+ */
+void hl_set_coalesce_mode(void *heap, int mode)
+{
+    heap_header_t *header = get_heap_header(heap);
+    if (header->tlsf_index != 0)
+    {
+        return;
+    }
+    __atomic_store_n(&header->coalesce_mode, mode, __ATOMIC_RELAXED);
+    if (mode == HL_COALESCE_EAGER)
+    {
+        hl_consolidate(heap);
+    }
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * Take every lock in lock order and rebuild all free lists from a walk over
+ * the heap.
+ */
+void hl_consolidate(void *heap)
+{
+    heap_header_t *header = get_heap_header(heap);
+    if (lock_all_classes(header) != SUCCESS)
+    {
+        return;
+    }
+    consolidate_heap(header);
+    unlock_all_classes(header);
+}
+
+/* (HELPER FUNCTION:) Returns SUCCESS if the heap header is what init_heap
+would have written for a heap of this size at this address. */
+int check_heap_header(void *heap, unsigned int heap_size)
+{
+    if (heap_size < MIN_HEAP_SIZE)
+    {
+        return FAILURE;
+    }
+    heap_header_t *header = get_heap_header(heap);
+    unsigned int heap_unaligned = (unsigned int)((char *)header - (char *)heap);
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != HEAP_MAGIC ||
+        header->size != ((heap_size - heap_unaligned) & SIZE_MASK) ||
+        (header->tlsf_index != 0 && header->tlsf_index != ((sizeof(heap_header_t) + 7) & SIZE_MASK)) ||
+        header->first_block != first_block_offset(header) || header->root >= header->size)
+    {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* (HELPER FUNCTION:) Walks every block and returns SUCCESS if the sizes are
+sane and add up to exactly the end of the heap, every state is known and the
+root (if any) is one of the blocks in use. Reads only. */
+int check_blocks(heap_header_t *header)
+{
+    int root_found = header->root == 0;
+    unsigned int offset = header->first_block;
+    while (offset < header->size)
+    {
+        block_header_t *current = block_at(header, offset);
+        unsigned int size = get_block_size(current);
+        unsigned int state = get_block_state(current);
+        if (size < MIN_BLOCK_SIZE || size > header->size - offset ||
+            (state != BLOCK_FREE && state != BLOCK_IN_USE && state != BLOCK_BINNED))
+        {
+            return FAILURE;
+        }
+        if (offset == header->root && state == BLOCK_IN_USE)
+        {
+            root_found = 1;
+        }
+        offset += size;
+    }
+    return root_found ? SUCCESS : FAILURE;
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * Check the header against what hl_init would have written for this size
+ * and walk the blocks (check_blocks). Locks left behind by the previous user
+ * are re-created, profiler flags are dropped and the free lists are rebuilt
+ * from a walk rather than trusted, which also repairs a shared heap that
+ * was marked broken.
+ */
+int hl_attach(void *heap, unsigned int heap_size)
+{
+    if (check_heap_header(heap, heap_size) != SUCCESS || check_blocks(get_heap_header(heap)) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    heap_header_t *header = get_heap_header(heap);
+    for (block_header_t *current = block_at(header, header->first_block); before_end(header, current);
+         current = (block_header_t *)get_next_block_head(current))
+    {
+        set_block_state(current, get_block_state(current));
+    }
+    init_heap_locks(header);
+    consolidate_heap(header);
+    header->broken = 0;
+    return SUCCESS;
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * The root is stored as an offset so it survives remapping.
+ */
+void hl_set_root(void *heap, void *block)
+{
+    heap_header_t *header = get_heap_header(heap);
+    unsigned int root = block == NULL ? 0 : offset_of(header, (block_header_t *)ADD_BYTES(block, -8));
+    __atomic_store_n(&header->root, root, __ATOMIC_RELEASE);
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function. */
+void *hl_get_root(void *heap)
+{
+    heap_header_t *header = get_heap_header(heap);
+    block_header_t *root = block_at(header, __atomic_load_n(&header->root, __ATOMIC_ACQUIRE));
+    return root == NULL ? NULL : ADD_BYTES(root, 8);
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function. */
+int hl_init_shared(void *heap, unsigned int heap_size)
+{
+    return init_heap(heap, heap_size, 1, 0);
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * The heap is live in other processes, so unlike hl_attach nothing is
+ * re-created: the header is checked and the blocks are walked under every
+ * lock of the heap.
+ */
+int hl_attach_shared(void *heap, unsigned int heap_size)
+{
+    if (check_heap_header(heap, heap_size) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    heap_header_t *header = get_heap_header(heap);
+    if (!header->pshared)
+    {
+        return FAILURE;
+    }
+    if (lock_all_classes(header) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    int ok = check_blocks(header);
+    unlock_all_classes(header);
+    return ok;
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function. */
+int hl_init_realtime(void *heap, unsigned int heap_size)
+{
+    return init_heap(heap, heap_size, 0, 1);
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * Allocate enough to slide the block forward to an aligned address while
+ * leaving a gap in front that is big enough to be a free block. Split that
+ * gap off (it goes back on the free list, merging with a free block before
+ * it) and trim whatever is left over at the end.
+ */
+void *hl_alloc_aligned(void *heap, unsigned int block_size, unsigned int alignment)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return FAILURE;
+    }
+    if (alignment <= 8)
+    {
+        return hl_alloc(heap, block_size);
+    }
+    heap_header_t *header = get_heap_header(heap);
+    unsigned int size = block_size_for(header, block_size);
+    if (size == 0 || size > header->size || alignment + MIN_FREE_BLOCK_SIZE > header->size - size)
+    {
+        return FAILURE;
+    }
+    block_header_t *block = alloc_block(heap, size + alignment + MIN_FREE_BLOCK_SIZE);
+    if (block == NULL)
+    {
+        return FAILURE;
+    }
+    uintptr_t payload = (uintptr_t)ADD_BYTES(block, 8);
+    uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned != payload && aligned - payload < MIN_FREE_BLOCK_SIZE)
+    {
+        aligned += alignment;
+    }
+    if (aligned != payload)
+    {
+        unsigned int gap = (unsigned int)(aligned - payload);
+        if (lock_heap(header, &header->heap_lock) != SUCCESS)
+        {
+            return FAILURE;
+        }
+        block_header_t *moved = (block_header_t *)ADD_BYTES(block, gap);
+        __atomic_store_n(&moved->block_size_t, get_block_size(block) - gap, __ATOMIC_RELAXED);
+        set_block_state(moved, BLOCK_IN_USE);
+        set_block_size(block, gap);
+        coalesce_block(header, block);
+        mutex_unlock(&header->heap_lock);
+        block = moved;
+    }
+    trim_block(header, block, size);
+    return hand_out_block(header, block, size, block_size);
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * Take every lock of the heap once, put all blocks back the way hl_release
+ * would, and settle the deferred mode bookkeeping once at the end. Sampled
+ * blocks are handed back to the profiler before the heap locks are taken.
+ */
+void hl_release_batch(void *heap, void **blocks, unsigned int count)
+{
+    heap_header_t *header = get_heap_header(heap);
+    unsigned int released = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (blocks[i] != NULL &&
+            __atomic_load_n(&((block_header_t *)ADD_BYTES(blocks[i], -8))->in_use, __ATOMIC_RELAXED) & BLOCK_SAMPLED)
+        {
+            hl_profile_forget(blocks[i]);
+        }
+    }
+    if (lock_all_classes(header) != SUCCESS)
+    {
+        return;
+    }
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (blocks[i] == NULL)
+        {
+            continue;
+        }
+        block_header_t *block_head = (block_header_t *)(ADD_BYTES(blocks[i], -8));
+        unsigned int size = get_block_size(block_head);
+        int index = header->tlsf_index == 0 ? class_index(size) : -1;
+        release_block(header, block_head, index);
+        released += index >= 0 ? 0 : size;
+    }
+    unlock_all_classes(header);
+    if (__atomic_load_n(&header->coalesce_mode, __ATOMIC_RELAXED) == HL_COALESCE_DEFERRED)
+    {
+        charge_deferred_bytes(heap, released);
+    }
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * alloc_block calls the handler with no locks held, once the allocation
+ * has missed, and then carves again, consolidating first if what the
+ * handler released sits unmerged on size class lists.
+ */
+hl_pressure_handler_t hl_set_pressure_handler(hl_pressure_handler_t handler)
+{
+    return __atomic_exchange_n(&pressure_handler, handler, __ATOMIC_ACQ_REL);
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * The block size alloc_block is asked for (block_size_for, the same call
+ * hl_alloc makes) minus the header.
+ */
+unsigned int hl_good_size(void *heap, unsigned int block_size)
+{
+    unsigned int size = block_size_for(get_heap_header(heap), block_size);
+    return size == 0 ? 0 : size - 8;
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * grow_block takes over free neighbours until max is reached and trims the
+ * excess, or puts them back if min cannot be reached.
+ */
+unsigned int hl_expand(void *heap, void *block, unsigned int min_size, unsigned int max_size)
+{
+    if (block == NULL)
+    {
+        return 0;
+    }
+    heap_header_t *header = get_heap_header(heap);
+    block_header_t *block_head = (block_header_t *)(ADD_BYTES(block, -8));
+    unsigned int min_block = block_size_for(header, min_size);
+    unsigned int max_block = block_size_for(header, max_size < min_size ? min_size : max_size);
+    if (min_block == 0 || max_block == 0)
+    {
+        return 0;
+    }
+    if (get_block_size(block_head) < max_block &&
+        grow_block(header, block_head, min_block, max_block) == FAILURE)
+    {
+        return 0;
+    }
+    return get_block_size(block_head) - 8;
+}
+
+/* See heaplib_ext.h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * The size comes from the block header, like in hl_release.
+ */
+unsigned int hl_usable_size(void *block)
+{
+    if (block == NULL)
+    {
+        return 0;
+    }
+    return get_block_size((block_header_t *)ADD_BYTES(block, -8)) - 8;
+}
@@ -0,0 +1,130 @@
+#ifndef HEAPLIB_EXT_H
+#define HEAPLIB_EXT_H
+
+/*
+ * Extensions to the interface in heaplib.h. All of these take a heap that
+ * was set up with hl_init.
+ *
+ * Every heap starts with a header holding its free lists and locks: 384
+ * bytes with 40 byte pthread mutexes (64-bit Linux), so a heap of
+ * MIN_HEAP_SIZE bytes has a little over 600 left for blocks. Realtime heaps
+ * also keep their TLSF index there, which grows with the heap size.
+ * Requests of up to 248 bytes are served from per size class lists, so
+ * threads working on different sizes mostly do not contend.
+ */
+
+/* Coalescing modes for hl_set_coalesce_mode */
+#define HL_COALESCE_EAGER 0    /* large blocks merge with free neighbours on release (default) */
+#define HL_COALESCE_DEFERRED 1 /* released blocks are not merged until the heap is consolidated */
+
+/* Selects when released blocks are coalesced. Small blocks always go on
+ * their size class list unmerged; in HL_COALESCE_DEFERRED mode larger blocks
+ * are also left unmerged, so releasing and reallocating the same size never
+ * merges and re-splits. Unmerged blocks are coalesced in bulk by
+ * hl_consolidate, which runs when an allocation misses while merging
+ * them may make room and, in deferred mode, after a quarter of the heap has
+ * been released since the last pass.
+ * Switching back to HL_COALESCE_EAGER consolidates immediately.
+ */
+void hl_set_coalesce_mode(void *heap, int mode);
+
+/* Merges every run of adjacent free blocks in the heap, including blocks
+ * waiting on size class lists, into single free blocks. Takes every lock of
+ * the heap and walks all blocks, so it is O(heap).
+ */
+void hl_consolidate(void *heap);
+
+/* Reattaches to a heap image that an earlier hl_init set up, e.g. a file
+ * mapped again after a restart or a copy at another address. The block
+ * layout only stores sizes and offsets, so the image may be mapped anywhere
+ * with the same alignment modulo 8. heap_size must match the original.
+ * Returns FAILURE, leaving the image untouched, if it does not look like a
+ * valid heap. The image must not be in use by anyone else (see
+ * hl_attach_shared for heaps that are).
+ */
+int hl_attach(void *heap, unsigned int heap_size);
+
+/* The root slot: one block per heap that can be found again after
+ * hl_attach, from which the rest of the data can be reached (by offsets).
+ * hl_get_root returns NULL if no root was set.
+ */
+void hl_set_root(void *heap, void *block);
+void *hl_get_root(void *heap);
+
+/* Like hl_init, but for a heap in memory shared between processes (e.g.
+ * shm_open + mmap): the heap's locks are process-shared. Other processes
+ * join the heap with hl_attach_shared, at whatever address they mapped it.
+ * Blocks should be exchanged between processes as offsets from the heap.
+ * If a process dies while holding one of the heap's locks, the heap may be
+ * half updated: it is marked broken, and from then on allocations fail,
+ * releases do nothing and hl_attach_shared fails, in every process, instead
+ * of deadlocking them. hl_attach (once no process uses the heap any more)
+ * checks it and rebuilds it.
+ */
+int hl_init_shared(void *heap, unsigned int heap_size);
+
+/* Joins a heap that another process set up with hl_init_shared and may be
+ * using right now. Returns FAILURE if the heap is not (yet) set up or does
+ * not look valid.
+ */
+int hl_attach_shared(void *heap, unsigned int heap_size);
+
+/* Like hl_init, but sets up a realtime heap: hl_alloc, hl_release and
+ * hl_resize run in bounded time (apart from the copy when hl_resize moves a
+ * block), independent of the heap size and its fragmentation. Free blocks
+ * are kept in a two-level segregated fit index and coalesced immediately;
+ * size class lists, deferred coalescing and consolidation on a miss are not
+ * used. The index costs a few hundred bytes at the front of the heap, and
+ * every block takes at least 24 bytes.
+ */
+int hl_init_realtime(void *heap, unsigned int heap_size);
+
+/* Like hl_alloc, but the block is aligned to alignment bytes, which must be
+ * a power of two. The block is released with hl_release as usual.
+ */
+void *hl_alloc_aligned(void *heap, unsigned int block_size, unsigned int alignment);
+
+/* Releases count blocks of the heap (NULL entries are skipped), as if by
+ * hl_release on each, but takes the heap's locks only once for the whole
+ * batch.
+ */
+void hl_release_batch(void *heap, void **blocks, unsigned int count);
+
+/* Called when an allocation is about to fail, with the heap it is for.
+ * Returns nonzero if it released something, in which case the allocation
+ * is retried once.
+ */
+typedef int (*hl_pressure_handler_t)(void *heap);
+
+/* Installs handler (NULL for none) for every heap in the process, except
+ * realtime heaps, which never call it. The handler may call hl_release on
+ * the heap but should not allocate from it. There is one handler per
+ * process: returns the one it replaces, so a library installing its own
+ * can call it in turn (see hl_cache_install_reclaim) or put it back.
+ */
+hl_pressure_handler_t hl_set_pressure_handler(hl_pressure_handler_t handler);
+
+/* Returns the usable size of the block hl_alloc(heap, block_size) asks
+ * for: the request rounded up the way this heap rounds it (realtime heaps
+ * never hand out blocks under 24 bytes), so that growable buffers can ask
+ * for exactly that much. Blocks come out this size, except that a block
+ * carved off a free block keeps the rest of it (8 or 16 bytes) when that
+ * is too small to split off; hl_usable_size reports those bytes too.
+ * Returns 0 for sizes that cannot be allocated.
+ */
+unsigned int hl_good_size(void *heap, unsigned int block_size);
+
+/* Grows block in place, never moving it: to max_size bytes if the memory
+ * right after the block is free, otherwise as far as possible. Returns the
+ * block's new usable size, which is at least min_size, or 0 (leaving the
+ * block as it was) if it cannot grow to min_size in place. A block that
+ * already holds max_size bytes is left as it is.
+ */
+unsigned int hl_expand(void *heap, void *block, unsigned int min_size, unsigned int max_size);
+
+/* Returns the number of bytes usable in an allocated block (at least what
+ * was asked for), or 0 for NULL.
+ */
+unsigned int hl_usable_size(void *block);
+
+#endif
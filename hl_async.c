@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "heaplib.h"
+#include "heaplib_ext.h"
+#include "hl_async.h"
+
+#define DEFAULT_QUEUE_SIZE 1024
+#define BATCH_SIZE 256
+
+/* How long the reclaimer sleeps when nobody wakes it. */
+#define RECLAIM_INTERVAL_NS 5000000L
+
+/*
+ * One thread's queue. The owner only writes tail, the reclaimer only writes
+ * head; both are free-running counters (the slot is the counter modulo the
+ * queue size), kept on separate cache lines. When its thread exits a queue
+ * is handed to the next thread that needs one, so there are never more
+ * queues than threads that ran at the same time.
+ */
+typedef struct _queue_t
+{
+    struct _queue_t *next;
+    int in_use; /* owned by a live thread */
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    void *blocks[];
+} queue_t;
+
+struct _hl_async_t
+{
+    void *heap;
+    unsigned int queue_size;
+    queue_t *queues;  /* only ever pushed to, until hl_async_stop */
+    pthread_key_t key; /* each thread's queue, given up at thread exit */
+    pthread_t reclaimer;
+    pthread_mutex_t lock; /* guards the fields below */
+    pthread_cond_t wake;  /* the reclaimer waits here */
+    pthread_cond_t done;  /* flushing and throttled threads wait here */
+    int wake_pending;
+    int stopping;
+    unsigned long flush_requested;
+    unsigned long flush_done;
+};
+
+/* (HELPER FUNCTION:) Thread exit: gives up the thread's queue. Blocks still
+in it are released by the reclaimer as usual, and the next owner carries on
+from its tail. */
+static void drop_queue(void *arg)
+{
+    queue_t *queue = (queue_t *)arg;
+    __atomic_store_n(&queue->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* (HELPER FUNCTION:) Returns the calling thread's queue, claiming one given
+up by an exited thread or adding a new one on first use. Returns NULL if
+there is no memory for one. */
+static queue_t *own_queue(hl_async_t *async)
+{
+    queue_t *queue = (queue_t *)pthread_getspecific(async->key);
+    if (queue != NULL)
+    {
+        return queue;
+    }
+    for (queue = __atomic_load_n(&async->queues, __ATOMIC_ACQUIRE); queue != NULL; queue = queue->next)
+    {
+        int free_queue = 0;
+        if (__atomic_compare_exchange_n(&queue->in_use, &free_queue, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    if (queue == NULL)
+    {
+        size_t bytes = sizeof(queue_t) + async->queue_size * sizeof(void *);
+        if (posix_memalign((void **)&queue, 64, bytes) != 0)
+        {
+            return NULL;
+        }
+        memset(queue, 0, bytes);
+        queue->in_use = 1;
+        queue->next = __atomic_load_n(&async->queues, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&async->queues, &queue->next, queue, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+    }
+    if (pthread_setspecific(async->key, queue) != 0)
+    {
+        drop_queue(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+/* (HELPER FUNCTION:) Wakes the reclaimer. (Must hold async->lock.) */
+static void wake_reclaimer(hl_async_t *async)
+{
+    __atomic_store_n(&async->wake_pending, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&async->wake);
+}
+
+/* (HELPER FUNCTION:) Empties every queue, releasing the blocks BATCH_SIZE at
+a time. Slots are handed back to their owner as soon as they are copied. */
+static void drain_queues(hl_async_t *async)
+{
+    void *batch[BATCH_SIZE];
+    unsigned int count = 0;
+    unsigned int mask = async->queue_size - 1;
+    for (queue_t *queue = __atomic_load_n(&async->queues, __ATOMIC_ACQUIRE); queue != NULL; queue = queue->next)
+    {
+        unsigned long head = queue->head;
+        unsigned long tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            batch[count++] = queue->blocks[head++ & mask];
+            if (count == BATCH_SIZE)
+            {
+                __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+                hl_release_batch(async->heap, batch, count);
+                count = 0;
+            }
+        }
+        __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+    }
+    if (count > 0)
+    {
+        hl_release_batch(async->heap, batch, count);
+    }
+}
+
+/* (HELPER FUNCTION:) The reclaimer thread. Sleeps until woken or until
+RECLAIM_INTERVAL_NS have passed, drains the queues, then tells flushing and
+throttled threads how far it got. */
+static void *reclaim(void *arg)
+{
+    hl_async_t *async = (hl_async_t *)arg;
+    pthread_mutex_lock(&async->lock);
+    for (;;)
+    {
+        if (!async->wake_pending && !async->stopping && async->flush_done == async->flush_requested)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += RECLAIM_INTERVAL_NS;
+            if (until.tv_nsec >= 1000000000L)
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&async->wake, &async->lock, &until);
+        }
+        __atomic_store_n(&async->wake_pending, 0, __ATOMIC_RELAXED);
+        int stopping = async->stopping;
+        unsigned long flush_requested = async->flush_requested;
+        pthread_mutex_unlock(&async->lock);
+
+        drain_queues(async);
+
+        pthread_mutex_lock(&async->lock);
+        async->flush_done = flush_requested;
+        pthread_cond_broadcast(&async->done);
+        if (stopping)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+hl_async_t *hl_async_start(void *heap, unsigned int queue_size)
+{
+    hl_async_t *async = (hl_async_t *)calloc(1, sizeof(hl_async_t));
+    if (async == NULL)
+    {
+        return NULL;
+    }
+    async->heap = heap;
+    async->queue_size = 1;
+    while (async->queue_size < (queue_size == 0 ? DEFAULT_QUEUE_SIZE : queue_size))
+    {
+        async->queue_size <<= 1;
+    }
+    if (pthread_key_create(&async->key, drop_queue) != 0)
+    {
+        free(async);
+        return NULL;
+    }
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->wake, NULL);
+    pthread_cond_init(&async->done, NULL);
+    if (pthread_create(&async->reclaimer, NULL, reclaim, async) != 0)
+    {
+        pthread_cond_destroy(&async->done);
+        pthread_cond_destroy(&async->wake);
+        pthread_mutex_destroy(&async->lock);
+        pthread_key_delete(async->key);
+        free(async);
+        return NULL;
+    }
+    return async;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * The fast path is one store into the ring and one release store of tail.
+ * Once the queue is half full the reclaimer is woken (at most once per
+ * pass, thanks to wake_pending). On a full queue wait for the reclaimer's
+ * next pass. Without memory for a queue, fall back to hl_release.
+ */
+void hl_release_async(hl_async_t *async, void *block)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+    queue_t *queue = own_queue(async);
+    if (queue == NULL)
+    {
+        hl_release(async->heap, block);
+        return;
+    }
+    unsigned long tail = queue->tail;
+    unsigned long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head == async->queue_size)
+    {
+        pthread_mutex_lock(&async->lock);
+        while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == async->queue_size)
+        {
+            wake_reclaimer(async);
+            pthread_cond_wait(&async->done, &async->lock);
+        }
+        pthread_mutex_unlock(&async->lock);
+        head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    }
+    queue->blocks[tail & (async->queue_size - 1)] = block;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    if (tail + 1 - head >= async->queue_size / 2 && !__atomic_load_n(&async->wake_pending, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&async->lock);
+        wake_reclaimer(async);
+        pthread_mutex_unlock(&async->lock);
+    }
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Take a ticket and wait for a reclaimer pass that started after it was
+ * taken; that pass sees every block queued before.
+ */
+void hl_async_flush(hl_async_t *async)
+{
+    pthread_mutex_lock(&async->lock);
+    unsigned long ticket = ++async->flush_requested;
+    wake_reclaimer(async);
+    while (async->flush_done < ticket)
+    {
+        pthread_cond_wait(&async->done, &async->lock);
+    }
+    pthread_mutex_unlock(&async->lock);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Deleting the key first means threads that used async no longer run
+ * drop_queue on queues that are about to be freed.
+ */
+void hl_async_stop(hl_async_t *async)
+{
+    pthread_key_delete(async->key);
+    pthread_mutex_lock(&async->lock);
+    async->stopping = 1;
+    wake_reclaimer(async);
+    pthread_mutex_unlock(&async->lock);
+    pthread_join(async->reclaimer, NULL);
+
+    queue_t *queue = async->queues;
+    while (queue != NULL)
+    {
+        queue_t *next = queue->next;
+        free(queue);
+        queue = next;
+    }
+    pthread_cond_destroy(&async->done);
+    pthread_cond_destroy(&async->wake);
+    pthread_mutex_destroy(&async->lock);
+    free(async);
+}
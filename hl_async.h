@@ -0,0 +1,41 @@
+#ifndef HL_ASYNC_H
+#define HL_ASYNC_H
+
+/*
+ * Asynchronous release for latency-sensitive threads.
+ *
+ * hl_release_async only queues the block on a queue owned by the calling
+ * thread; a background reclaimer thread drains the queues of all threads
+ * and releases what it finds in batches with hl_release_batch, taking the
+ * heap's locks once per batch. Queues are single-producer single-consumer
+ * rings, so queuing takes no lock.
+ *
+ * Blocks released this way stay allocated until the reclaimer gets to them
+ * (it wakes when a queue is half full, on hl_async_flush, and otherwise
+ * every few milliseconds), so the heap may look fuller than it is.
+ */
+
+typedef struct _hl_async_t hl_async_t;
+
+/* Starts a reclaimer for heap. Each thread that calls hl_release_async gets
+ * a queue of queue_size blocks (rounded up to a power of two; 0 picks a
+ * default), which is handed on to another thread once it exits. Takes one
+ * pthread key until hl_async_stop. Returns NULL if the reclaimer cannot be
+ * started.
+ */
+hl_async_t *hl_async_start(void *heap, unsigned int queue_size);
+
+/* Queues block for release; NULL is a NOP. If the calling thread's queue is
+ * full the call waits until the reclaimer has made room (backpressure).
+ */
+void hl_release_async(hl_async_t *async, void *block);
+
+/* Returns once every block queued before the call has been released. */
+void hl_async_flush(hl_async_t *async);
+
+/* Releases everything still queued, stops the reclaimer and frees the
+ * queues. No thread may use async during or after the call.
+ */
+void hl_async_stop(hl_async_t *async);
+
+#endif
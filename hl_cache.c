@@ -0,0 +1,393 @@
+#include <stdint.h>
+#include <sched.h>
+#include "heaplib.h"
+#include "heaplib_ext.h"
+#include "hl_cache.h"
+#include "spinlock.h"
+
+/* Useful shorthand: casts a pointer to a (char *) before adding */
+#define ADD_BYTES(base_addr, num_bytes) (((char *)(base_addr)) + (num_bytes))
+
+/* Slabs are a power of two in size and aligned to their size, so the slab
+of an object is found by masking its address. A slab holds at least
+MIN_SLAB_OBJECTS objects and takes at least MIN_SLAB_SIZE bytes. */
+#define MIN_SLAB_SIZE 1024
+#define MIN_SLAB_OBJECTS 8
+
+/*
+ * Slab header, at the start of every slab, followed by the objects. Each
+ * object is followed by a link word that chains the free objects of the
+ * slab, so a free object's own bytes (its constructed state) are never
+ * touched.
+ */
+typedef struct _slab_t
+{
+    struct _slab_t *next;
+    struct _slab_t *prev;
+    void *free_objects;
+    unsigned int in_use;
+} slab_t;
+
+/*
+ * A slab is on one of three lists: partial (some objects in use, some
+ * free), full (no free objects) or empty (no objects in use). Allocation
+ * prefers partial slabs, so empty slabs stay empty and can be reaped.
+ */
+struct _hl_cache_t
+{
+    void *heap;
+    unsigned int size;
+    unsigned int stride;       /* object plus link word, rounded to the alignment */
+    unsigned int first_object; /* offset of the first object in a slab */
+    unsigned int slab_size;
+    unsigned int objects_per_slab;
+    void (*ctor)(void *object);
+    void (*dtor)(void *object);
+    lock_t lock; /* guards the slab lists and every slab's free objects */
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty;
+    struct _hl_cache_t *next; /* in the registry */
+    unsigned int reclaiming;  /* hl_cache_reclaim calls still destroying slabs of this cache (registry_lock) */
+};
+
+/* Every cache, for hl_cache_reclaim. Never held while allocating from a
+heap, since that may call hl_cache_reclaim, nor while running destructors,
+which may do anything. */
+#ifdef __riscv
+volatile lock_t registry_lock = {.riscv_lock = 0};
+#else
+volatile lock_t registry_lock = {.pthread_lock = PTHREAD_MUTEX_INITIALIZER};
+#endif
+static hl_cache_t *caches = NULL;
+
+/* The pressure handler hl_cache_install_reclaim replaced, called when the
+caches have nothing to release. */
+static hl_pressure_handler_t previous_handler = NULL;
+
+/* (HELPER FUNCTION:) Rounds size up to a multiple of align (a power of two). */
+static unsigned int round_up(unsigned int size, unsigned int align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/* (HELPER FUNCTION:) The link word that follows an object. */
+static void **link_of(hl_cache_t *cache, void *object)
+{
+    return (void **)ADD_BYTES(object, round_up(cache->size, sizeof(void *)));
+}
+
+/* (HELPER FUNCTION:) The slab an object lives in. */
+static slab_t *slab_of(hl_cache_t *cache, void *object)
+{
+    return (slab_t *)((uintptr_t)object & ~(uintptr_t)(cache->slab_size - 1));
+}
+
+/* (HELPER FUNCTION:) Unlinks a slab from the list at *list. */
+static void slab_unlink(slab_t **list, slab_t *slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *list = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* (HELPER FUNCTION:) Pushes a slab on the list at *list. */
+static void slab_push(slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+    {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/* (HELPER FUNCTION:) Allocates a slab from the heap and constructs all of
+its objects. Returns NULL if the heap is full. (Must not hold cache->lock:
+the allocation may end up in hl_cache_reclaim.) */
+static slab_t *slab_create(hl_cache_t *cache)
+{
+    slab_t *slab = (slab_t *)hl_alloc_aligned(cache->heap, cache->slab_size, cache->slab_size);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+    slab->in_use = 0;
+    slab->free_objects = NULL;
+    for (unsigned int i = cache->objects_per_slab; i > 0; i--)
+    {
+        void *object = ADD_BYTES(slab, cache->first_object + (i - 1) * cache->stride);
+        if (cache->ctor != NULL)
+        {
+            cache->ctor(object);
+        }
+        *link_of(cache, object) = slab->free_objects;
+        slab->free_objects = object;
+    }
+    return slab;
+}
+
+/* (HELPER FUNCTION:) Destroys the objects of a slab and releases it. Objects
+still in use are not destroyed. Returns the slab size. */
+static unsigned int slab_destroy(hl_cache_t *cache, slab_t *slab)
+{
+    if (cache->dtor != NULL)
+    {
+        for (void *object = slab->free_objects; object != NULL; object = *link_of(cache, object))
+        {
+            cache->dtor(object);
+        }
+    }
+    hl_release(cache->heap, slab);
+    return cache->slab_size;
+}
+
+/* (HELPER FUNCTION:) Destroys every slab on a detached list. */
+static unsigned int destroy_list(hl_cache_t *cache, slab_t *slab)
+{
+    unsigned int released = 0;
+    while (slab != NULL)
+    {
+        slab_t *next = slab->next;
+        released += slab_destroy(cache, slab);
+        slab = next;
+    }
+    return released;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Pick the smallest slab size that fits MIN_SLAB_OBJECTS objects after the
+ * slab header. The descriptor is allocated before registry_lock is taken,
+ * since allocating may reclaim.
+ */
+hl_cache_t *hl_cache_create(void *heap, unsigned int size, unsigned int align,
+                            void (*ctor)(void *object), void (*dtor)(void *object))
+{
+    align = align == 0 ? 8 : align;
+    if (size == 0 || size > (1u << 24) || (align & (align - 1)) != 0 || align > (1u << 12))
+    {
+        return NULL;
+    }
+    hl_cache_t *cache = (hl_cache_t *)hl_alloc(heap, sizeof(hl_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->heap = heap;
+    cache->size = size;
+    cache->stride = round_up(round_up(size, sizeof(void *)) + sizeof(void *), align < sizeof(void *) ? sizeof(void *) : align);
+    cache->first_object = round_up(sizeof(slab_t), align);
+    cache->slab_size = MIN_SLAB_SIZE;
+    while (cache->slab_size < cache->first_object + MIN_SLAB_OBJECTS * cache->stride)
+    {
+        cache->slab_size <<= 1;
+    }
+    cache->objects_per_slab = (cache->slab_size - cache->first_object) / cache->stride;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+#ifdef __riscv
+    cache->lock.riscv_lock = 0;
+#else
+    pthread_mutex_init((pthread_mutex_t *)&cache->lock.pthread_lock, NULL);
+#endif
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->reclaiming = 0;
+
+    mutex_lock(&registry_lock);
+    cache->next = caches;
+    caches = cache;
+    mutex_unlock(&registry_lock);
+    return cache;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Take a free object from a partial slab, else from an empty one, else grow
+ * the cache by a slab (constructed outside the lock) and try again.
+ */
+void *hl_cache_alloc(hl_cache_t *cache)
+{
+    slab_t *fresh = NULL;
+    for (;;)
+    {
+        mutex_lock(&cache->lock);
+        if (fresh != NULL)
+        {
+            slab_push(&cache->empty, fresh);
+            fresh = NULL;
+        }
+        slab_t **list = cache->partial != NULL ? &cache->partial : &cache->empty;
+        slab_t *slab = *list;
+        if (slab != NULL)
+        {
+            void *object = slab->free_objects;
+            slab->free_objects = *link_of(cache, object);
+            slab->in_use++;
+            if (list == &cache->empty || slab->free_objects == NULL)
+            {
+                slab_unlink(list, slab);
+                slab_push(slab->free_objects == NULL ? &cache->full : &cache->partial, slab);
+            }
+            mutex_unlock(&cache->lock);
+            return object;
+        }
+        mutex_unlock(&cache->lock);
+        fresh = slab_create(cache);
+        if (fresh == NULL)
+        {
+            return NULL;
+        }
+    }
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void hl_cache_free(hl_cache_t *cache, void *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+    slab_t *slab = slab_of(cache, object);
+    mutex_lock(&cache->lock);
+    int was_full = slab->free_objects == NULL;
+    *link_of(cache, object) = slab->free_objects;
+    slab->free_objects = object;
+    slab->in_use--;
+    if (was_full || slab->in_use == 0)
+    {
+        slab_unlink(was_full ? &cache->full : &cache->partial, slab);
+        slab_push(slab->in_use == 0 ? &cache->empty : &cache->partial, slab);
+    }
+    mutex_unlock(&cache->lock);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Detach the empty list under the lock; the destructors and the releases
+ * run outside it.
+ */
+unsigned int hl_cache_reap(hl_cache_t *cache)
+{
+    mutex_lock(&cache->lock);
+    slab_t *empty = cache->empty;
+    cache->empty = NULL;
+    mutex_unlock(&cache->lock);
+    return destroy_list(cache, empty);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * One cache at a time: under registry_lock, find a cache of the heap with
+ * empty slabs, detach them and pin the cache (reclaiming) so that
+ * hl_cache_destroy waits for us. The destructors and the releases run after
+ * registry_lock is dropped.
+ */
+int hl_cache_reclaim(void *heap)
+{
+    unsigned int released = 0;
+    for (;;)
+    {
+        hl_cache_t *cache;
+        slab_t *empty = NULL;
+        mutex_lock(&registry_lock);
+        for (cache = caches; cache != NULL; cache = cache->next)
+        {
+            if (cache->heap == heap)
+            {
+                mutex_lock(&cache->lock);
+                empty = cache->empty;
+                cache->empty = NULL;
+                mutex_unlock(&cache->lock);
+            }
+            if (empty != NULL)
+            {
+                cache->reclaiming++;
+                break;
+            }
+        }
+        mutex_unlock(&registry_lock);
+        if (cache == NULL)
+        {
+            return released > 0;
+        }
+
+        released += destroy_list(cache, empty);
+        mutex_lock(&registry_lock);
+        cache->reclaiming--;
+        mutex_unlock(&registry_lock);
+    }
+}
+
+/* (HELPER FUNCTION:) The handler hl_cache_install_reclaim installs. */
+static int reclaim_then_previous(void *heap)
+{
+    if (hl_cache_reclaim(heap))
+    {
+        return 1;
+    }
+    hl_pressure_handler_t previous = __atomic_load_n(&previous_handler, __ATOMIC_ACQUIRE);
+    return previous != NULL && previous(heap);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * registry_lock keeps two installs from chaining the handler to itself.
+ */
+hl_pressure_handler_t hl_cache_install_reclaim(void)
+{
+    mutex_lock(&registry_lock);
+    hl_pressure_handler_t replaced = hl_set_pressure_handler(reclaim_then_previous);
+    if (replaced != reclaim_then_previous)
+    {
+        __atomic_store_n(&previous_handler, replaced, __ATOMIC_RELEASE);
+    }
+    hl_pressure_handler_t previous = __atomic_load_n(&previous_handler, __ATOMIC_RELAXED);
+    mutex_unlock(&registry_lock);
+    return previous;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Once the cache is out of the registry no new hl_cache_reclaim can pin it;
+ * wait for those still destroying its slabs before tearing it down.
+ */
+void hl_cache_destroy(hl_cache_t *cache)
+{
+    mutex_lock(&registry_lock);
+    for (hl_cache_t **current = &caches; *current != NULL; current = &(*current)->next)
+    {
+        if (*current == cache)
+        {
+            *current = cache->next;
+            break;
+        }
+    }
+    while (cache->reclaiming > 0)
+    {
+        mutex_unlock(&registry_lock);
+        sched_yield();
+        mutex_lock(&registry_lock);
+    }
+    mutex_unlock(&registry_lock);
+
+    destroy_list(cache, cache->empty);
+    destroy_list(cache, cache->partial);
+    destroy_list(cache, cache->full);
+#ifndef __riscv
+    pthread_mutex_destroy((pthread_mutex_t *)&cache->lock.pthread_lock);
+#endif
+    hl_release(cache->heap, cache);
+}
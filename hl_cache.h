@@ -0,0 +1,56 @@
+#ifndef HL_CACHE_H
+#define HL_CACHE_H
+
+/*
+ * Object caches (after Bonwick's slab allocator) on top of an hl heap.
+ *
+ * A cache hands out objects of one size that stay constructed while they
+ * are cached: ctor runs once per object when the cache grows, dtor once
+ * when the cache shrinks, not on every hl_cache_alloc/hl_cache_free. An
+ * object must therefore be returned to the cache in its constructed state
+ * (e.g. with its embedded lock unlocked).
+ *
+ * Objects live in slabs allocated from the heap with hl_alloc_aligned.
+ * Slabs whose objects are all free are kept until hl_cache_reap, or until
+ * the heap runs out of memory once hl_cache_install_reclaim was called.
+ */
+
+typedef struct _hl_cache_t hl_cache_t;
+
+/* Creates a cache of size byte objects aligned to align bytes (a power of
+ * two; 0 means 8). ctor and dtor may be NULL. The cache's bookkeeping is
+ * allocated from heap too. Returns NULL if the arguments are invalid or
+ * the heap is full.
+ */
+hl_cache_t *hl_cache_create(void *heap, unsigned int size, unsigned int align,
+                            void (*ctor)(void *object), void (*dtor)(void *object));
+
+/* Returns a constructed object, or NULL if the heap is full. */
+void *hl_cache_alloc(hl_cache_t *cache);
+
+/* Puts object, constructed, back into the cache it came from; NULL is a
+ * NOP.
+ */
+void hl_cache_free(hl_cache_t *cache, void *object);
+
+/* Destroys the objects of every slab with no object in use and releases
+ * those slabs to the heap. Returns the number of bytes released.
+ */
+unsigned int hl_cache_reap(hl_cache_t *cache);
+
+/* Reaps every cache on heap. Returns nonzero if anything was released. */
+int hl_cache_reclaim(void *heap);
+
+/* Makes allocations that would fail reclaim cached objects first: installs
+ * a pressure handler that calls hl_cache_reclaim and, if that released
+ * nothing, the handler that was installed before (so the application's own
+ * handler keeps working). Calling it again while the cache handler is
+ * installed changes nothing. Returns the handler it replaced, which
+ * hl_set_pressure_handler puts back.
+ */
+hl_pressure_handler_t hl_cache_install_reclaim(void);
+
+/* Destroys the cache. Every object must have been freed back to it. */
+void hl_cache_destroy(hl_cache_t *cache);
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "heaplib.h"
+#include "heaplib_ext.h"
+#include "hl_epoch.h"
+#include "spinlock.h"
+
+/*
+ * Three-epoch scheme. The global epoch only advances from e to e + 1 once
+ * every thread inside a critical section has announced e, so a block
+ * retired in epoch e can no longer be seen by anyone once the global epoch
+ * reaches e + 2. Each thread keeps its retired blocks in NUM_BUCKETS
+ * buckets, one per epoch modulo 3.
+ */
+#define NUM_BUCKETS 3
+
+/* Entries per chunk of a bucket. */
+#define CHUNK_ENTRIES 62
+
+/* Every this many hl_retire calls a thread tries to advance the epoch and
+releases what has expired. */
+#define RETIRE_BATCH 64
+
+typedef struct
+{
+    void *heap;
+    void *block;
+} retired_t;
+
+typedef struct _chunk_t
+{
+    struct _chunk_t *next;
+    unsigned int count;
+    retired_t entries[CHUNK_ENTRIES];
+} chunk_t;
+
+typedef struct
+{
+    unsigned long epoch;
+    chunk_t *chunks;
+} bucket_t;
+
+/*
+ * One per thread, reused once the thread exits. announced is the epoch the
+ * thread entered its critical section in, shifted left by one, with the low
+ * bit set while it is inside one (0 outside).
+ */
+typedef struct _record_t
+{
+    unsigned long announced __attribute__((aligned(64)));
+    int in_use;
+    unsigned int retired;
+    bucket_t buckets[NUM_BUCKETS];
+    struct _record_t *next;
+} record_t;
+
+/* Buckets left behind by exited threads, released by whoever reclaims. */
+typedef struct _orphan_t
+{
+    bucket_t bucket;
+    struct _orphan_t *next;
+} orphan_t;
+
+static unsigned long global_epoch = 0;
+static record_t *records = NULL; /* only ever pushed to */
+
+/* Guards the orphans. */
+#ifdef __riscv
+volatile lock_t epoch_lock = {.riscv_lock = 0};
+#else
+volatile lock_t epoch_lock = {.pthread_lock = PTHREAD_MUTEX_INITIALIZER};
+#endif
+static orphan_t *orphans = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+
+static __thread record_t *own_record = NULL;
+static __thread unsigned int nesting = 0;
+
+/* (HELPER FUNCTION:) Releases every block in a bucket and empties it. Runs
+of blocks from the same heap go to hl_release_batch together. */
+static void release_bucket(bucket_t *bucket)
+{
+    void *batch[CHUNK_ENTRIES];
+    chunk_t *chunk = bucket->chunks;
+    while (chunk != NULL)
+    {
+        unsigned int start = 0;
+        for (unsigned int i = 0; i < chunk->count; i++)
+        {
+            batch[i] = chunk->entries[i].block;
+            if (i + 1 == chunk->count || chunk->entries[i + 1].heap != chunk->entries[start].heap)
+            {
+                hl_release_batch(chunk->entries[start].heap, &batch[start], i + 1 - start);
+                start = i + 1;
+            }
+        }
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    bucket->chunks = NULL;
+}
+
+/* (HELPER FUNCTION:) Thread exit: hands the thread's retired blocks over to
+the orphans and frees its record for the next thread. */
+static void drop_record(void *arg)
+{
+    record_t *record = (record_t *)arg;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        orphan_t *orphan = record->buckets[i].chunks == NULL ? NULL : (orphan_t *)malloc(sizeof(orphan_t));
+        if (orphan == NULL)
+        {
+            /* Nothing to hand over, or no memory to do so: leak rather
+            than release blocks someone may still be reading. */
+            record->buckets[i].chunks = NULL;
+            continue;
+        }
+        orphan->bucket = record->buckets[i];
+        record->buckets[i].chunks = NULL;
+        mutex_lock(&epoch_lock);
+        orphan->next = orphans;
+        __atomic_store_n(&orphans, orphan, __ATOMIC_RELAXED);
+        mutex_unlock(&epoch_lock);
+    }
+    record->retired = 0;
+    __atomic_store_n(&record->announced, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&record_key, drop_record);
+}
+
+/* (HELPER FUNCTION:) Returns the calling thread's record, claiming a free
+one or adding a new one on first use. Returns NULL if there is no memory. */
+static record_t *get_record(void)
+{
+    if (own_record != NULL)
+    {
+        return own_record;
+    }
+    pthread_once(&key_once, create_key);
+    record_t *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; record != NULL; record = record->next)
+    {
+        int free_record = 0;
+        if (__atomic_compare_exchange_n(&record->in_use, &free_record, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    if (record == NULL)
+    {
+        if (posix_memalign((void **)&record, 64, sizeof(record_t)) != 0)
+        {
+            return NULL;
+        }
+        *record = (record_t){.in_use = 1};
+        record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &record->next, record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+    }
+    pthread_setspecific(record_key, record);
+    own_record = record;
+    return record;
+}
+
+/* (HELPER FUNCTION:) Moves the global epoch on if every thread inside a
+critical section has caught up with it. Returns the global epoch. */
+static unsigned long try_advance(void)
+{
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (record_t *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+    {
+        unsigned long announced = __atomic_load_n(&record->announced, __ATOMIC_SEQ_CST);
+        if ((announced & 1) && (announced >> 1) != epoch)
+        {
+            return epoch;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+/* (HELPER FUNCTION:) Releases the calling thread's buckets, and the
+orphans, that are two or more epochs behind. */
+static void reclaim(record_t *record)
+{
+    unsigned long epoch = try_advance();
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        if (record->buckets[i].chunks != NULL && record->buckets[i].epoch + 2 <= epoch)
+        {
+            release_bucket(&record->buckets[i]);
+        }
+    }
+    if (__atomic_load_n(&orphans, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+    orphan_t *expired = NULL;
+    mutex_lock(&epoch_lock);
+    for (orphan_t **current = &orphans; *current != NULL;)
+    {
+        orphan_t *orphan = *current;
+        if (orphan->bucket.epoch + 2 <= epoch)
+        {
+            __atomic_store_n(current, orphan->next, __ATOMIC_RELAXED);
+            orphan->next = expired;
+            expired = orphan;
+        }
+        else
+        {
+            current = &orphan->next;
+        }
+    }
+    mutex_unlock(&epoch_lock);
+    while (expired != NULL)
+    {
+        orphan_t *next = expired->next;
+        release_bucket(&expired->bucket);
+        free(expired);
+        expired = next;
+    }
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Announce the current epoch, then fence so the announcement is visible
+ * before any shared node is read.
+ */
+int hl_epoch_enter(void)
+{
+    if (nesting > 0)
+    {
+        nesting++;
+        return SUCCESS;
+    }
+    record_t *record = get_record();
+    if (record == NULL)
+    {
+        return FAILURE;
+    }
+    nesting = 1;
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->announced, (epoch << 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return SUCCESS;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void hl_epoch_exit(void)
+{
+    if (--nesting > 0)
+    {
+        return;
+    }
+    __atomic_store_n(&own_record->announced, 0, __ATOMIC_RELEASE);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * File the block under the current epoch. A bucket that still holds an
+ * older epoch is at least three epochs old, so it is released first.
+ */
+int hl_retire(void *heap, void *block)
+{
+    if (block == NULL)
+    {
+        return SUCCESS;
+    }
+    record_t *record = get_record();
+    if (record == NULL)
+    {
+        return FAILURE;
+    }
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    bucket_t *bucket = &record->buckets[epoch % NUM_BUCKETS];
+    if (bucket->epoch != epoch)
+    {
+        release_bucket(bucket);
+        bucket->epoch = epoch;
+    }
+    chunk_t *chunk = bucket->chunks;
+    if (chunk == NULL || chunk->count == CHUNK_ENTRIES)
+    {
+        chunk = (chunk_t *)malloc(sizeof(chunk_t));
+        if (chunk == NULL)
+        {
+            return FAILURE;
+        }
+        chunk->count = 0;
+        chunk->next = bucket->chunks;
+        bucket->chunks = chunk;
+    }
+    chunk->entries[chunk->count++] = (retired_t){.heap = heap, .block = block};
+    if (++record->retired % RETIRE_BATCH == 0)
+    {
+        reclaim(record);
+    }
+    return SUCCESS;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void hl_epoch_flush(void)
+{
+    record_t *record = own_record;
+    if (record == NULL)
+    {
+        return;
+    }
+    for (;;)
+    {
+        reclaim(record);
+        int pending = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++)
+        {
+            pending |= record->buckets[i].chunks != NULL;
+        }
+        if (!pending)
+        {
+            return;
+        }
+        sched_yield();
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef HL_EPOCH_H
+#define HL_EPOCH_H
+
+/*
+ * Epoch-based reclamation for lock-free data structures on hl heaps.
+ *
+ * Readers bracket every access to shared nodes with hl_epoch_enter and
+ * hl_epoch_exit. A writer that unlinks a node hands it to hl_retire instead
+ * of hl_release; the node is released once every thread that was inside a
+ * critical section at that point has left it. Retired blocks are released
+ * in batches with hl_release_batch, so small ones go straight back on
+ * their size class list.
+ *
+ * There is one epoch domain per process, shared by all heaps.
+ */
+
+/* Enters a critical section: blocks reachable now will not be released
+ * before the matching hl_epoch_exit. Sections may nest. Costs a load, a
+ * store and a fence. Returns FAILURE, without entering, if there is no
+ * memory to register the calling thread (only possible on its first call).
+ */
+int hl_epoch_enter(void);
+
+/* Leaves the critical section entered by the matching hl_epoch_enter. */
+void hl_epoch_exit(void);
+
+/* Releases block to heap once no critical section that might still see it
+ * is left. Blocks retired by one thread are released a batch at a time, by
+ * that thread, from later hl_retire calls (or by other threads' calls once
+ * it has exited). Returns FAILURE (and does not retire the block) if there
+ * is no memory to keep track of it.
+ */
+int hl_retire(void *heap, void *block);
+
+/* Waits until every block the calling thread retired has been released.
+ * Must not be called inside a critical section (it would wait for itself).
+ */
+void hl_epoch_flush(void);
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "heaplib.h"
+#include "heaplib_ext.h"
+#include "hl_persist.h"
+
+/* See the .h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * An empty (or new) file is grown to *heap_size and formatted with hl_init;
+ * anything else must pass hl_attach. The mapping is page aligned, so the
+ * heap header lands at the same place in the file every time. The file is
+ * flocked; the mapping keeps the open file (and so the lock) alive after the
+ * descriptor is closed, until hl_persist_close unmaps it. A new file that
+ * could not be set up is truncated back to empty, so the next open formats
+ * it again instead of failing hl_attach for good (or removed, if even that
+ * fails).
+ */
+void *hl_persist_open(const char *path, unsigned int *heap_size, int *created)
+{
+    unsigned int size = *heap_size;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    int is_new = st.st_size == 0;
+    if (is_new)
+    {
+        if (size < MIN_HEAP_SIZE || ftruncate(fd, size) != 0)
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+    else if (size == 0 && (unsigned long)st.st_size <= 0xffffffffu)
+    {
+        size = (unsigned int)st.st_size;
+    }
+    else if ((unsigned long)st.st_size != size)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *heap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int ok = FAILURE;
+    if (heap != MAP_FAILED)
+    {
+        ok = is_new ? hl_init(heap, size) : hl_attach(heap, size);
+        if (ok != SUCCESS)
+        {
+            munmap(heap, size);
+        }
+    }
+    if (ok != SUCCESS && is_new && ftruncate(fd, 0) != 0)
+    {
+        unlink(path);
+    }
+    close(fd);
+    if (ok != SUCCESS)
+    {
+        return NULL;
+    }
+    *heap_size = size;
+    if (created != NULL)
+    {
+        *created = is_new;
+    }
+    return heap;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+int hl_persist_sync(void *heap, unsigned int heap_size)
+{
+    return msync(heap, heap_size, MS_SYNC) == 0 ? SUCCESS : FAILURE;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void hl_persist_close(void *heap, unsigned int heap_size)
+{
+    msync(heap, heap_size, MS_SYNC);
+    munmap(heap, heap_size);
+}
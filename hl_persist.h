@@ -0,0 +1,27 @@
+#ifndef HL_PERSIST_H
+#define HL_PERSIST_H
+
+/*
+ * File-backed heaps. The heap lives in a file mapped with mmap(MAP_SHARED),
+ * so everything allocated from it (and reachable from its root, see
+ * hl_set_root) is still there when the file is opened again, e.g. after a
+ * restart. Only one process may have a given file open at a time.
+ */
+
+/* Maps the heap file at path, creating it with *heap_size bytes if it does
+ * not exist. An existing file is validated with hl_attach; *heap_size must
+ * then match its size, or be 0 to take the size from the file. On success
+ * *heap_size holds the size of the heap (to pass to hl_persist_sync and
+ * hl_persist_close) and, if created is not NULL, *created is set to 1 for a
+ * new heap and 0 for a reopened one. Returns the heap, or NULL on failure
+ * (leaving *heap_size as it was).
+ */
+void *hl_persist_open(const char *path, unsigned int *heap_size, int *created);
+
+/* Flushes the heap to its file. Returns SUCCESS or FAILURE. */
+int hl_persist_sync(void *heap, unsigned int heap_size);
+
+/* Flushes and unmaps a heap returned by hl_persist_open. */
+void hl_persist_close(void *heap, unsigned int heap_size);
+
+#endif
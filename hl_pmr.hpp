@@ -0,0 +1,144 @@
+#ifndef HL_PMR_HPP
+#define HL_PMR_HPP
+
+#include <climits>
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+extern "C"
+{
+#include "heaplib.h"
+#include "heaplib_ext.h"
+}
+
+/*
+ * C++ adapters over an hl heap (C++17).
+ *
+ * hl::heap_resource is a std::pmr::memory_resource, for pmr containers:
+ *
+ *   hl::heap_resource resource(heap);
+ *   std::pmr::vector<int> v(&resource);
+ *
+ * For allocate-only phases put a monotonic buffer on top of it, so that the
+ * container's many small allocations become a few large hl_alloc calls that
+ * are all released when the buffer goes away:
+ *
+ *   std::pmr::monotonic_buffer_resource arena(1 << 16, &resource);
+ *   std::pmr::unordered_map<int, int> m(&arena);
+ *
+ * hl::heap_allocator<T> is a plain (non-pmr) allocator for std containers:
+ *
+ *   std::vector<int, hl::heap_allocator<int>> v(hl::heap_allocator<int>(heap));
+ *
+ * Both only hold the heap pointer; the heap must outlive them and everything
+ * allocated through them. Both throw std::bad_alloc when the heap is full.
+ */
+
+namespace hl
+{
+
+/* Allocates with hl_alloc_aligned, so any power of two alignment is honored.
+ * Deallocation ignores the size argument: hl_release reads the size from the
+ * block header.
+ */
+class heap_resource : public std::pmr::memory_resource
+{
+public:
+    explicit heap_resource(void *heap) noexcept : heap_(heap) {}
+
+    void *heap() const noexcept { return heap_; }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (bytes > UINT_MAX || alignment > UINT_MAX)
+        {
+            throw std::bad_alloc();
+        }
+        void *block = hl_alloc_aligned(heap_, static_cast<unsigned int>(bytes),
+                                       static_cast<unsigned int>(alignment));
+        if (block == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return block;
+    }
+
+    void do_deallocate(void *block, std::size_t, std::size_t) override
+    {
+        hl_release(heap_, block);
+    }
+
+    /* Two resources are interchangeable if they allocate from the same heap. */
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const heap_resource *resource = dynamic_cast<const heap_resource *>(&other);
+        return resource != nullptr && resource->heap_ == heap_;
+    }
+
+private:
+    void *heap_;
+};
+
+/* A stateful allocator: the heap travels with the container, including on
+ * copy, move and swap, so blocks are always released to the heap they came
+ * from.
+ */
+template <class T>
+class heap_allocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit heap_allocator(void *heap) noexcept : heap_(heap) {}
+
+    template <class U>
+    heap_allocator(const heap_allocator<U> &other) noexcept : heap_(other.heap()) {}
+
+    void *heap() const noexcept { return heap_; }
+
+    T *allocate(std::size_t n)
+    {
+        if (n > UINT_MAX / sizeof(T))
+        {
+            throw std::bad_alloc();
+        }
+        void *block = alignof(T) > 8
+                          ? hl_alloc_aligned(heap_, static_cast<unsigned int>(n * sizeof(T)), alignof(T))
+                          : hl_alloc(heap_, static_cast<unsigned int>(n * sizeof(T)));
+        if (block == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(block);
+    }
+
+    void deallocate(T *block, std::size_t) noexcept
+    {
+        hl_release(heap_, block);
+    }
+
+private:
+    void *heap_;
+};
+
+template <class T, class U>
+bool operator==(const heap_allocator<T> &a, const heap_allocator<U> &b) noexcept
+{
+    return a.heap() == b.heap();
+}
+
+template <class T, class U>
+bool operator!=(const heap_allocator<T> &a, const heap_allocator<U> &b) noexcept
+{
+    return a.heap() != b.heap();
+}
+
+} // namespace hl
+
+#endif
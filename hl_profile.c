@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "heaplib.h"
+#include "hl_profile.h"
+#include "spinlock.h"
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
+
+/*
+ * Guards the table of sampled blocks. Only the sampling slow path and the
+ * release of a sampled block take it.
+ */
+#ifdef __riscv
+volatile lock_t profile_lock = {.riscv_lock = 0};
+#else
+volatile lock_t profile_lock = {.pthread_lock = PTHREAD_MUTEX_INITIALIZER};
+#endif
+
+#define MAX_STACK_DEPTH 32
+#define NUM_BUCKETS 1024
+
+/* While disarmed, threads look at sample_interval again after this many
+bytes, so arming the profiler takes effect without touching the fast path. */
+#define DISARMED_RECHECK_BYTES (1L << 20)
+
+/* Frames belonging to the profiler itself. The allocator's own frames stay
+in the stack (how many depends on inlining); pprof's -hide option can drop
+them from reports. */
+#define SKIP_FRAMES 1
+
+typedef struct _sample_t
+{
+    void *block;
+    unsigned int size;
+    int depth;
+    void *stack[MAX_STACK_DEPTH];
+    struct _sample_t *next;
+} sample_t;
+
+static __thread uint64_t rng_state = 0;
+
+static volatile unsigned int sample_interval = 0;
+static sample_t *buckets[NUM_BUCKETS];
+
+/* (HELPER FUNCTION:) Hashes a block address into the sample table. */
+static unsigned int bucket_of(void *block)
+{
+    return (unsigned int)(((uintptr_t)block >> 3) * 2654435761u) % NUM_BUCKETS;
+}
+
+/* (HELPER FUNCTION:) Cheap log2 approximation (exponent plus linear
+mantissa), good enough to shape the sampling distribution without libm. */
+static double fast_log2(double d)
+{
+    union
+    {
+        double d;
+        uint64_t bits;
+    } u = {.d = d};
+    int exponent = (int)((u.bits >> 52) & 0x7ff) - 1023;
+    u.bits = (u.bits & ~(0x7ffull << 52)) | (1023ull << 52);
+    return exponent + (u.d - 1.0);
+}
+
+/* (HELPER FUNCTION:) Picks the number of bytes until the next sample. The
+gap is exponentially distributed with mean interval, which is what pprof
+assumes when it scales "heap_v2" samples back up. */
+static long next_sample_gap(unsigned int interval)
+{
+    if (rng_state == 0)
+    {
+        rng_state = (uintptr_t)&rng_state | 1;
+    }
+    rng_state = rng_state * 6364136223846793005ull + 1442695040888963407ull;
+    double q = (double)(rng_state >> 38) + 1.0; /* uniform in [1, 2^26] */
+    double gap = (26.0 - fast_log2(q)) * 0.6931471805599453 * interval;
+    return (long)gap + 1;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Other threads notice at their next recheck (DISARMED_RECHECK_BYTES); the
+ * calling thread draws its first gap right away.
+ */
+void hl_profile_start(unsigned int sample_bytes)
+{
+    unsigned int interval = sample_bytes == 0 ? 1 : sample_bytes;
+    __atomic_store_n(&sample_interval, interval, __ATOMIC_RELAXED);
+    hl_profile_countdown = next_sample_gap(interval);
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void hl_profile_stop(void)
+{
+    __atomic_store_n(&sample_interval, 0, __ATOMIC_RELAXED);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Reached when the thread's countdown ran out. If the profiler is disarmed
+ * this just rearms the countdown for the next recheck. Otherwise capture the
+ * stack, remember the block and draw the next sampling gap.
+ */
+int hl_profile_sample(void *block, unsigned int size)
+{
+    unsigned int interval = __atomic_load_n(&sample_interval, __ATOMIC_RELAXED);
+    if (interval == 0)
+    {
+        hl_profile_countdown = DISARMED_RECHECK_BYTES;
+        return FAILURE;
+    }
+    hl_profile_countdown = next_sample_gap(interval);
+
+    sample_t *sample = (sample_t *)malloc(sizeof(sample_t));
+    if (sample == NULL)
+    {
+        return FAILURE;
+    }
+    void *stack[MAX_STACK_DEPTH + SKIP_FRAMES];
+    int depth = 0;
+#ifdef __GLIBC__
+    depth = backtrace(stack, MAX_STACK_DEPTH + SKIP_FRAMES);
+#endif
+    depth = depth > SKIP_FRAMES ? depth - SKIP_FRAMES : 0;
+    memcpy(sample->stack, stack + SKIP_FRAMES, depth * sizeof(void *));
+    sample->depth = depth;
+    sample->block = block;
+    sample->size = size;
+
+    unsigned int bucket = bucket_of(block);
+    mutex_lock(&profile_lock);
+    sample->next = buckets[bucket];
+    buckets[bucket] = sample;
+    mutex_unlock(&profile_lock);
+    return SUCCESS;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Only called for blocks hl_alloc marked as sampled.
+ */
+void hl_profile_forget(void *block)
+{
+    unsigned int bucket = bucket_of(block);
+    sample_t *found = NULL;
+    mutex_lock(&profile_lock);
+    for (sample_t **current = &buckets[bucket]; *current != NULL; current = &(*current)->next)
+    {
+        if ((*current)->block == block)
+        {
+            found = *current;
+            *current = found->next;
+            break;
+        }
+    }
+    mutex_unlock(&profile_lock);
+    free(found);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Legacy pprof heap profile: a header line with the totals and the sampling
+ * interval, one line per live sampled block with its stack, then the
+ * process mappings so pprof can symbolize the addresses.
+ */
+int hl_profile_dump(FILE *out)
+{
+    unsigned long objects = 0;
+    unsigned long bytes = 0;
+    unsigned int interval = __atomic_load_n(&sample_interval, __ATOMIC_RELAXED);
+
+    mutex_lock(&profile_lock);
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        for (sample_t *sample = buckets[i]; sample != NULL; sample = sample->next)
+        {
+            objects++;
+            bytes += sample->size;
+        }
+    }
+    fprintf(out, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%u\n",
+            objects, bytes, objects, bytes, interval);
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        for (sample_t *sample = buckets[i]; sample != NULL; sample = sample->next)
+        {
+            fprintf(out, "1: %u [1: %u] @", sample->size, sample->size);
+            for (int j = 0; j < sample->depth; j++)
+            {
+                fprintf(out, " %p", sample->stack[j]);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    mutex_unlock(&profile_lock);
+
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL)
+    {
+        char line[512];
+        while (fgets(line, sizeof(line), maps) != NULL)
+        {
+            fputs(line, out);
+        }
+        fclose(maps);
+    }
+    return ferror(out) ? FAILURE : SUCCESS;
+}
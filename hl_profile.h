@@ -0,0 +1,41 @@
+#ifndef HL_PROFILE_H
+#define HL_PROFILE_H
+
+#include <stdio.h>
+
+/*
+ * Sampling heap profiler for the hl_* allocator.
+ *
+ * While armed, roughly one allocation per sample_bytes allocated bytes is
+ * sampled: its stack trace is captured and it is tracked until it is
+ * released. hl_profile_dump writes the live sampled blocks in the legacy
+ * pprof heap profile format ("heap_v2"), which `pprof` reads directly and
+ * which is also readable as plain text. Blocks of shared heaps
+ * (hl_init_shared) are not sampled, since other processes may release them.
+ */
+
+/* Arms the profiler with a mean sampling interval of sample_bytes. Takes
+ * effect at once in the calling thread, and in other threads within their
+ * next 1 MiB of allocations.
+ */
+void hl_profile_start(unsigned int sample_bytes);
+
+/* Disarms the profiler. Blocks sampled so far stay tracked until released. */
+void hl_profile_stop(void);
+
+/* Writes the current profile to out. Returns SUCCESS or FAILURE. */
+int hl_profile_dump(FILE *out);
+
+/*
+ * Used by heaplib.c. hl_alloc subtracts every allocation from the calling
+ * thread's countdown and only calls hl_profile_sample once it goes negative,
+ * so the armed-but-not-firing cost is one decrement. hl_profile_sample
+ * returns SUCCESS if it recorded the block, and only then is the block's
+ * release passed to hl_profile_forget. heaplib.c refers to both weakly, so
+ * it can be linked without this module.
+ */
+extern __thread long hl_profile_countdown;
+int hl_profile_sample(void *block, unsigned int size);
+void hl_profile_forget(void *block);
+
+#endif
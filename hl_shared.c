@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "heaplib.h"
+#include "heaplib_ext.h"
+#include "hl_shared.h"
+
+/* How long a joining process waits for the creator to set the heap up. */
+#define JOIN_ATTEMPTS 1000
+#define JOIN_WAIT_US 1000
+
+/* See the .h for the advertised behavior of this library function.
+ * These comments describe the implementation, not the interface.
+ *
+ * O_EXCL decides which process creates the heap. Joiners wait for the
+ * object to reach its full size and for hl_attach_shared to accept it:
+ * hl_init_shared writes the heap's magic word last, so until then the heap
+ * is simply "not set up yet".
+ */
+void *hl_shared_open(const char *name, unsigned int heap_size, int *created)
+{
+    if (heap_size < MIN_HEAP_SIZE)
+    {
+        return NULL;
+    }
+    int is_new = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        is_new = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (is_new && ftruncate(fd, heap_size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    struct stat st;
+    for (int i = 0; !is_new && i < JOIN_ATTEMPTS; i++)
+    {
+        if (fstat(fd, &st) == 0 && (unsigned long)st.st_size >= heap_size)
+        {
+            break;
+        }
+        usleep(JOIN_WAIT_US);
+    }
+
+    void *heap = mmap(NULL, heap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (heap == MAP_FAILED)
+    {
+        return NULL;
+    }
+    int ok = FAILURE;
+    if (is_new)
+    {
+        ok = hl_init_shared(heap, heap_size);
+    }
+    for (int i = 0; !is_new && ok != SUCCESS && i < JOIN_ATTEMPTS; i++)
+    {
+        ok = hl_attach_shared(heap, heap_size);
+        if (ok != SUCCESS)
+        {
+            usleep(JOIN_WAIT_US);
+        }
+    }
+    if (ok != SUCCESS)
+    {
+        munmap(heap, heap_size);
+        return NULL;
+    }
+    if (created != NULL)
+    {
+        *created = is_new;
+    }
+    return heap;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void hl_shared_close(void *heap, unsigned int heap_size)
+{
+    munmap(heap, heap_size);
+}
+
+/* See the .h for the advertised behavior of this library function. */
+int hl_shared_unlink(const char *name)
+{
+    return shm_unlink(name) == 0 ? SUCCESS : FAILURE;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+unsigned long hl_shared_offset(void *heap, void *block)
+{
+    return block == NULL ? 0 : (unsigned long)((char *)block - (char *)heap);
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void *hl_shared_pointer(void *heap, unsigned long offset)
+{
+    return offset == 0 ? NULL : (char *)heap + offset;
+}
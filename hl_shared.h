@@ -0,0 +1,34 @@
+#ifndef HL_SHARED_H
+#define HL_SHARED_H
+
+/*
+ * Heaps shared between processes. The heap lives in a POSIX shared memory
+ * object; every process that opens it maps it (at whatever address) and
+ * allocates and releases blocks in it, with the heap's locks kept inside
+ * the shared memory. Pass blocks between processes as offsets
+ * (hl_shared_offset / hl_shared_pointer), never as pointers.
+ */
+
+/* Opens the shared memory object name (e.g. "/tables"), creating and
+ * formatting a heap of heap_size bytes if it does not exist yet, otherwise
+ * joining the existing heap (waiting briefly for its creator to finish
+ * setting it up). If created is not NULL it is set to 1 for the process
+ * that created the heap. Returns the heap, or NULL on failure.
+ */
+void *hl_shared_open(const char *name, unsigned int heap_size, int *created);
+
+/* Unmaps the heap from this process. The heap itself lives on. */
+void hl_shared_close(void *heap, unsigned int heap_size);
+
+/* Removes the shared memory object; the heap goes away once every process
+ * has closed it. Returns SUCCESS or FAILURE.
+ */
+int hl_shared_unlink(const char *name);
+
+/* Converts between blocks and offsets that mean the same thing in every
+ * process attached to the heap. Offset 0 is the NULL block.
+ */
+unsigned long hl_shared_offset(void *heap, void *block);
+void *hl_shared_pointer(void *heap, unsigned long offset);
+
+#endif
@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "heaplib.h"
+#include "heaplib_ext.h"
+#include "hl_tenant.h"
+#include "spinlock.h"
+
+/*
+ * The radix map covers 48 bit addresses in 4 KiB regions, three levels of
+ * 4096 entries each. A leaf entry points at the lowest (by address)
+ * registered heap that overlaps its region; heaps are also kept in a list
+ * sorted by address, so a region shared by the end of one heap and the
+ * start of the next is resolved by following that list. Interior nodes and
+ * leaves are never freed, so lookups need no lock.
+ */
+#define REGION_SHIFT 12
+#define LEVEL_BITS 12
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+
+typedef struct _tenant_t
+{
+    char *start;
+    char *end;
+    unsigned long quota;
+    unsigned long used;
+    struct _tenant_t *next;      /* next registered heap by address */
+    struct _tenant_t *next_free; /* on the free list once unregistered */
+} tenant_t;
+
+typedef struct
+{
+    tenant_t *entries[LEVEL_SIZE];
+} leaf_t;
+
+typedef struct
+{
+    leaf_t *leaves[LEVEL_SIZE];
+} node_t;
+
+static node_t *root[LEVEL_SIZE];
+
+/* Guards registration: the sorted list, the free list and creating nodes.
+Lookups and accounting do not take it. */
+#ifdef __riscv
+volatile lock_t tenant_lock = {.riscv_lock = 0};
+#else
+volatile lock_t tenant_lock = {.pthread_lock = PTHREAD_MUTEX_INITIALIZER};
+#endif
+static tenant_t *tenants = NULL;
+/* Unregistered records are recycled, never freed, since a lookup may still
+be walking through one. */
+static tenant_t *free_tenants = NULL;
+
+/* (HELPER FUNCTION:) Returns the leaf entry for the region of address, or
+NULL if its leaf does not exist. With create set, missing nodes are made
+(must hold tenant_lock); NULL then means there was no memory. */
+static tenant_t **leaf_entry(uintptr_t address, int create)
+{
+    uintptr_t region = address >> REGION_SHIFT;
+    node_t **node = &root[(region >> (2 * LEVEL_BITS)) & LEVEL_MASK];
+    if (__atomic_load_n(node, __ATOMIC_ACQUIRE) == NULL)
+    {
+        node_t *fresh = create ? (node_t *)calloc(1, sizeof(node_t)) : NULL;
+        if (fresh == NULL)
+        {
+            return NULL;
+        }
+        __atomic_store_n(node, fresh, __ATOMIC_RELEASE);
+    }
+    leaf_t **leaf = &(*node)->leaves[(region >> LEVEL_BITS) & LEVEL_MASK];
+    if (__atomic_load_n(leaf, __ATOMIC_ACQUIRE) == NULL)
+    {
+        leaf_t *fresh = create ? (leaf_t *)calloc(1, sizeof(leaf_t)) : NULL;
+        if (fresh == NULL)
+        {
+            return NULL;
+        }
+        __atomic_store_n(leaf, fresh, __ATOMIC_RELEASE);
+    }
+    return &(*leaf)->entries[region & LEVEL_MASK];
+}
+
+/* (HELPER FUNCTION:) Returns the tenant whose heap contains address, or
+NULL. Three dependent loads in the common case. */
+static tenant_t *lookup(void *address)
+{
+    tenant_t **entry = leaf_entry((uintptr_t)address, 0);
+    tenant_t *tenant = entry == NULL ? NULL : __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    while (tenant != NULL && tenant->start <= (char *)address)
+    {
+        if ((char *)address < tenant->end)
+        {
+            return tenant;
+        }
+        tenant = __atomic_load_n(&tenant->next, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+/* (HELPER FUNCTION:) Charges bytes to the tenant. Returns FAILURE, charging
+nothing, if that would take it over its quota. */
+static int charge(tenant_t *tenant, unsigned long bytes)
+{
+    unsigned long used = __atomic_add_fetch(&tenant->used, bytes, __ATOMIC_RELAXED);
+    if (tenant->quota != 0 && used > tenant->quota)
+    {
+        __atomic_sub_fetch(&tenant->used, bytes, __ATOMIC_RELAXED);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* (HELPER FUNCTION:) Credits bytes back to the tenant. Usage stops at 0
+rather than wrapping around if more is credited than was charged. */
+static void credit(tenant_t *tenant, unsigned long bytes)
+{
+    unsigned long used = __atomic_load_n(&tenant->used, __ATOMIC_RELAXED);
+    unsigned long left;
+    do
+    {
+        left = used > bytes ? used - bytes : 0;
+    } while (!__atomic_compare_exchange_n(&tenant->used, &used, left, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* (HELPER FUNCTION:) Settles the charge for a block that was charged
+charged bytes and turned out to hold usable bytes. */
+static void settle(tenant_t *tenant, unsigned long charged, unsigned long usable)
+{
+    if (usable > charged)
+    {
+        __atomic_add_fetch(&tenant->used, usable - charged, __ATOMIC_RELAXED);
+    }
+    else if (usable < charged)
+    {
+        credit(tenant, charged - usable);
+    }
+}
+
+/* (HELPER FUNCTION:) Returns the tenant of a block of heap, or NULL if heap
+is not registered or the block is not inside it. */
+static tenant_t *tenant_of(void *heap, void *block)
+{
+    tenant_t *tenant = lookup(heap);
+    return tenant != NULL && lookup(block) == tenant ? tenant : NULL;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Create every leaf the heap needs first, so that failing leaves the
+ * registry as it was. Then link the record into the sorted list and point
+ * every region at it where it is now the lowest heap overlapping.
+ */
+int hl_tenant_register(void *heap, unsigned int heap_size, unsigned long quota)
+{
+    char *start = (char *)heap;
+    char *end = start + heap_size;
+    if (heap_size == 0)
+    {
+        return FAILURE;
+    }
+    mutex_lock(&tenant_lock);
+    tenant_t **link = &tenants;
+    while (*link != NULL && (*link)->start < end)
+    {
+        if ((*link)->end > start)
+        {
+            mutex_unlock(&tenant_lock);
+            return FAILURE;
+        }
+        link = &(*link)->next;
+    }
+    uintptr_t last = ((uintptr_t)end - 1) >> REGION_SHIFT;
+    for (uintptr_t region = (uintptr_t)start >> REGION_SHIFT; region <= last; region++)
+    {
+        if (leaf_entry(region << REGION_SHIFT, 1) == NULL)
+        {
+            mutex_unlock(&tenant_lock);
+            return FAILURE;
+        }
+    }
+    tenant_t *tenant = free_tenants;
+    if (tenant != NULL)
+    {
+        free_tenants = tenant->next_free;
+    }
+    else if ((tenant = (tenant_t *)malloc(sizeof(tenant_t))) == NULL)
+    {
+        mutex_unlock(&tenant_lock);
+        return FAILURE;
+    }
+    tenant->start = start;
+    tenant->end = end;
+    tenant->quota = quota;
+    tenant->used = 0;
+    tenant->next = *link;
+    __atomic_store_n(link, tenant, __ATOMIC_RELEASE);
+
+    for (uintptr_t region = (uintptr_t)start >> REGION_SHIFT; region <= last; region++)
+    {
+        tenant_t **entry = leaf_entry(region << REGION_SHIFT, 1);
+        if (*entry == NULL || (*entry)->start > start)
+        {
+            __atomic_store_n(entry, tenant, __ATOMIC_RELEASE);
+        }
+    }
+    mutex_unlock(&tenant_lock);
+    return SUCCESS;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Regions that pointed at the heap now point at the next heap if it starts
+ * inside them, else at nothing: no lower heap can overlap such a region,
+ * or it would have been the one pointed at.
+ */
+void hl_tenant_unregister(void *heap)
+{
+    mutex_lock(&tenant_lock);
+    tenant_t **link = &tenants;
+    while (*link != NULL && (*link)->start != (char *)heap)
+    {
+        link = &(*link)->next;
+    }
+    tenant_t *tenant = *link;
+    if (tenant == NULL)
+    {
+        mutex_unlock(&tenant_lock);
+        return;
+    }
+    __atomic_store_n(link, tenant->next, __ATOMIC_RELEASE);
+
+    uintptr_t last = ((uintptr_t)tenant->end - 1) >> REGION_SHIFT;
+    for (uintptr_t region = (uintptr_t)tenant->start >> REGION_SHIFT; region <= last; region++)
+    {
+        tenant_t **entry = leaf_entry(region << REGION_SHIFT, 0);
+        if (*entry == tenant)
+        {
+            tenant_t *next = tenant->next;
+            int next_overlaps = next != NULL && (uintptr_t)next->start >> REGION_SHIFT == region;
+            __atomic_store_n(entry, next_overlaps ? next : NULL, __ATOMIC_RELEASE);
+        }
+    }
+    tenant->next_free = free_tenants;
+    free_tenants = tenant;
+    mutex_unlock(&tenant_lock);
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Charge the minimum usable size before allocating, so concurrent allocations
+ * cannot overshoot the quota together, then correct it to the size the
+ * block really got.
+ */
+void *hl_tenant_alloc(void *heap, unsigned int block_size)
+{
+    tenant_t *tenant = lookup(heap);
+    unsigned int size = hl_good_size(heap, block_size);
+    if (tenant == NULL || size == 0)
+    {
+        return FAILURE;
+    }
+    if (charge(tenant, size) == FAILURE)
+    {
+        return FAILURE;
+    }
+    void *block = hl_alloc(heap, block_size);
+    if (block == NULL)
+    {
+        credit(tenant, size);
+        return FAILURE;
+    }
+    settle(tenant, size, hl_usable_size(block));
+    return block;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Growth is charged before resizing, like in hl_tenant_alloc; whatever the
+ * block ends up holding is settled afterwards. A moved block keeps the
+ * charge of the old one, which hl_resize releases.
+ */
+void *hl_tenant_resize(void *heap, void *block, unsigned int new_size)
+{
+    if (block == NULL)
+    {
+        return hl_tenant_alloc(heap, new_size);
+    }
+    tenant_t *tenant = tenant_of(heap, block);
+    unsigned int size = hl_good_size(heap, new_size);
+    if (tenant == NULL || size == 0)
+    {
+        return FAILURE;
+    }
+    unsigned int old_usable = hl_usable_size(block);
+    unsigned int growth = size > old_usable ? size - old_usable : 0;
+    if (growth != 0 && charge(tenant, growth) == FAILURE)
+    {
+        return FAILURE;
+    }
+    void *resized = hl_resize(heap, block, new_size);
+    if (resized == NULL)
+    {
+        credit(tenant, growth);
+        return FAILURE;
+    }
+    settle(tenant, old_usable + growth, hl_usable_size(resized));
+    return resized;
+}
+
+/* See the .h for the advertised behavior of this library function.
+ *
+ * Try to charge for growing all the way to max_size; if the quota does not
+ * allow that, charge for min_size and grow no further than it.
+ */
+unsigned int hl_tenant_expand(void *heap, void *block, unsigned int min_size, unsigned int max_size)
+{
+    tenant_t *tenant = block == NULL ? NULL : tenant_of(heap, block);
+    unsigned int min_usable = hl_good_size(heap, min_size);
+    unsigned int max_usable = hl_good_size(heap, max_size < min_size ? min_size : max_size);
+    if (tenant == NULL || min_usable == 0 || max_usable == 0)
+    {
+        return 0;
+    }
+    unsigned int old_usable = hl_usable_size(block);
+    unsigned int growth = max_usable > old_usable ? max_usable - old_usable : 0;
+    if (growth != 0 && charge(tenant, growth) == FAILURE)
+    {
+        max_size = min_size;
+        growth = min_usable > old_usable ? min_usable - old_usable : 0;
+        if (growth != 0 && charge(tenant, growth) == FAILURE)
+        {
+            return 0;
+        }
+    }
+    unsigned int usable = hl_expand(heap, block, min_size, max_size);
+    settle(tenant, old_usable + growth, usable == 0 ? old_usable : usable);
+    return usable;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void hl_tenant_free(void *block)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+    tenant_t *tenant = lookup(block);
+    if (tenant == NULL)
+    {
+        return;
+    }
+    credit(tenant, hl_usable_size(block));
+    hl_release(tenant->start, block);
+}
+
+/* See the .h for the advertised behavior of this library function. */
+void *hl_tenant_heap_of(void *ptr)
+{
+    tenant_t *tenant = lookup(ptr);
+    return tenant == NULL ? NULL : tenant->start;
+}
+
+/* See the .h for the advertised behavior of this library function. */
+unsigned long hl_tenant_usage(void *heap)
+{
+    tenant_t *tenant = lookup(heap);
+    return tenant == NULL ? 0 : __atomic_load_n(&tenant->used, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+#ifndef HL_TENANT_H
+#define HL_TENANT_H
+
+/*
+ * Registry of heaps for processes that give every tenant its own heap.
+ *
+ * A registered heap is found again from any address inside it through a
+ * radix map over the address space, so hl_tenant_free needs nothing but the
+ * block. Each tenant can be given a quota: hl_tenant_alloc charges the
+ * usable size of every block against it with one atomic add, and fails if
+ * the request (rounded up by hl_good_size for its heap) would take the
+ * tenant over its quota. A block that comes out bigger than that (when
+ * splitting off the rest was not worth it) is charged in full, so usage can
+ * end up a few bytes over the quota.
+ *
+ * hl_tenant_free credits the block's usable size at the time, so a tenant
+ * block must only change size through hl_tenant_resize or hl_tenant_expand,
+ * which charge for the change; hl_resize or hl_expand on it would leave the
+ * tenant charged for the old size.
+ */
+
+/* Registers heap (set up with hl_init or one of its variants) as a tenant
+ * that may hold at most quota bytes in blocks (0 for no limit). Returns
+ * FAILURE if heap overlaps a registered heap or there is no memory for the
+ * registry.
+ */
+int hl_tenant_register(void *heap, unsigned int heap_size, unsigned long quota);
+
+/* Removes heap from the registry. No thread may use it through the
+ * registry during or after the call.
+ */
+void hl_tenant_unregister(void *heap);
+
+/* Like hl_alloc on a registered heap, but charged to the tenant's quota.
+ * Returns NULL if the heap is not registered, is full, or the block would
+ * exceed the quota.
+ */
+void *hl_tenant_alloc(void *heap, unsigned int block_size);
+
+/* Like hl_resize on a block allocated with hl_tenant_alloc from heap, with
+ * the change in its usable size charged to (or credited back to) the
+ * tenant. Returns NULL, leaving the block as it was, if the heap is full or
+ * growing would exceed the quota. A NULL block is allocated as with
+ * hl_tenant_alloc.
+ */
+void *hl_tenant_resize(void *heap, void *block, unsigned int new_size);
+
+/* Like hl_expand on a block allocated with hl_tenant_alloc from heap, with
+ * the growth charged to the tenant. Grows no further than min_size if the
+ * quota does not allow max_size. Returns 0, leaving the block as it was, if
+ * it cannot grow to min_size in place or within the quota.
+ */
+unsigned int hl_tenant_expand(void *heap, void *block, unsigned int min_size, unsigned int max_size);
+
+/* Releases a block allocated with hl_tenant_alloc, on whichever heap it
+ * belongs to, and credits its tenant. NULL is a NOP.
+ */
+void hl_tenant_free(void *block);
+
+/* Returns the registered heap that contains ptr, or NULL if none does. */
+void *hl_tenant_heap_of(void *ptr);
+
+/* Returns the bytes the tenant currently holds in blocks. */
+unsigned long hl_tenant_usage(void *heap);
+
+#endif
@@ -3,10 +3,21 @@
 #include <stdbool.h>
 #include <string.h>
 #include "heaplib.h"
+#include "heaplib_ext.h"
+#include "hl_profile.h"
+#include "hl_persist.h"
+#include "hl_shared.h"
+#include "hl_async.h"
+#include "hl_epoch.h"
+#include "hl_cache.h"
+#include "hl_tenant.h"
 #include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #define HEAP_SIZE 1024
-#define NUM_TESTS 24
+#define NUM_TESTS 31
 #define NPOINTERS 100
 
 // TODO: Add test descriptions as you add more tests...
@@ -27,17 +38,24 @@ const char *test_descriptions[] = {
     /* 11 */ "your description here",
     /* 12 */ "your description here",
     /* 13 */ "your description here",
-    /* 14 */ "your description here",
+    /* 14 */ "deferred coalescing reuses blocks unmerged, consolidates on a miss",
     /* 15 */ "example threading test",
     /* STRESS tests */
     /* 16 */ "alloc & free, stay within heap limits",
-    /* 17 */ "your description here",
-    /* 18 */ "your description here",
-    /* 19 */ "your description here",
-    /* 20 */ "your description here",
-    /* 21 */ "your description here",
-    /* 22 */ "your description here",
-    /* 23 */ "your description here",
+    /* 17 */ "threads allocating different sizes concurrently keep their blocks intact",
+    /* 18 */ "a heap image copied elsewhere reattaches with its root intact",
+    /* 19 */ "realtime heap survives random traffic and coalesces back to one block",
+    /* 20 */ "releasing blocks in batches returns them all and leaves the rest intact",
+    /* 21 */ "a full heap calls the pressure handler and retries the allocation",
+    /* 22 */ "good_size is the size alloc hands out on each kind of heap, expand grows in place or not at all",
+    /* 23 */ "every block's usable size covers the request and can be filled",
+    /* 24 */ "processes share a heap at different addresses; one dying under a lock breaks it, not the rest",
+    /* 25 */ "a retired block outlives every critical section that could see it, then comes back",
+    /* 26 */ "cached objects are constructed once, aligned, destroyed on reap and reclaimed under pressure",
+    /* 27 */ "an armed profiler dumps live sampled blocks and drops released ones",
+    /* 28 */ "a heap file reopened in the same process keeps its root, and is locked while open",
+    /* 29 */ "short-lived threads releasing asynchronously through small queues lose no block",
+    /* 30 */ "tenant heaps are found from any address in them and held to their quotas",
 };
 
 /* ------------------ COMPLETED SPEC TESTS ------------------------- */
@@ -441,16 +459,38 @@ int test13()
 /* Find something that you think heaplame does wrong. Make a test
  * for that thing!
  *
- * FUNCTIONS BEING TESTED:
- * SPECIFICATION BEING TESTED:
- *
- *
- * MANIFESTATION OF ERROR:
+ * FUNCTIONS BEING TESTED: alloc, release, set_coalesce_mode
+ * SPECIFICATION BEING TESTED: In deferred coalescing mode a released block
+ * is handed back unmerged for the same size, and a request that only fits
+ * once the released blocks are merged still succeeds.
  *
+ * MANIFESTATION OF ERROR: The same size comes back at a different address
+ * (the block was merged and re-split), or the large request fails because
+ * the unmerged blocks are never consolidated.
  */
 int test14()
 {
-    return FAILURE;
+    char heap[HEAP_SIZE * 2];
+    hl_init(heap, HEAP_SIZE * 2);
+    hl_set_coalesce_mode(heap, HL_COALESCE_DEFERRED);
+
+    char *blocks[12];
+    int n = 0;
+    while (n < 12 && (blocks[n] = hl_alloc(heap, 100)) != NULL)
+    {
+        n++;
+    }
+    hl_release(heap, blocks[1]);
+    char *again = hl_alloc(heap, 100);
+    if (again != blocks[1])
+    {
+        return FAILURE;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        hl_release(heap, blocks[i]);
+    }
+    return hl_alloc(heap, HEAP_SIZE) != NULL;
 }
 
 typedef struct
@@ -574,100 +614,1117 @@ int test16()
     return SUCCESS;
 }
 
+typedef struct
+{
+    int id;
+    void *heap;
+    pthread_barrier_t *barrier;
+    int ok;
+} stress_args;
+
+/* Each thread allocates blocks of its own size (one size class per thread
+ * plus some large blocks), fills them with its id and checks the contents
+ * before releasing them again.
+ */
+void *size_class_thread(void *ptr)
+{
+    stress_args *args = (stress_args *)ptr;
+    unsigned int size = 8 * (args->id + 1);
+    char *blocks[8];
+    pthread_barrier_wait(args->barrier);
+    args->ok = 1;
+    for (int iter = 0; iter < 2000; iter++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            unsigned int n = (i == 7) ? size * 16 : size;
+            blocks[i] = hl_alloc(args->heap, n);
+            if (blocks[i] != NULL)
+            {
+                memset(blocks[i], args->id, n);
+            }
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            unsigned int n = (i == 7) ? size * 16 : size;
+            for (unsigned int j = 0; blocks[i] != NULL && j < n; j++)
+            {
+                if (blocks[i][j] != (char)args->id)
+                {
+                    args->ok = 0;
+                }
+            }
+            hl_release(args->heap, blocks[i]);
+        }
+    }
+    return NULL;
+}
+
 /* Stress the heap library and see if you can break it!
  *
- * FUNCTIONS BEING TESTED:
+ * FUNCTIONS BEING TESTED: alloc, release (threaded)
  * INTEGRITY OR DATA CORRUPTION?
+ * Threads allocating different sizes run concurrently, each on its own
+ * size class lock, while sharing the heap lock for large blocks.
  *
  * MANIFESTATION OF ERROR:
- *
+ * A block handed to two threads at once (or a corrupted free list) shows up
+ * as a block whose contents were overwritten by another thread, a crash,
+ * or a deadlock.
  */
 int test17()
 {
+    static char heap[HEAP_SIZE * 64];
+    int n_threads = 8;
+    pthread_t threads[n_threads];
+    stress_args args[n_threads];
+    pthread_barrier_t barrier;
 
-    return FAILURE;
+    hl_init(heap, sizeof(heap));
+    pthread_barrier_init(&barrier, NULL, n_threads);
+    for (int i = 0; i < n_threads; i++)
+    {
+        args[i] = (stress_args){.id = i, .heap = heap, .barrier = &barrier, .ok = 0};
+        pthread_create(&threads[i], NULL, size_class_thread, (void *)&args[i]);
+    }
+    int ok = 1;
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ok = ok && args[i].ok;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    // everything was released, so a large block must fit again
+    return ok && hl_alloc(heap, HEAP_SIZE * 32) != NULL;
 }
 
 /* Stress the heap library and see if you can break it!
  *
- * FUNCTIONS BEING TESTED:
+ * FUNCTIONS BEING TESTED: attach, set_root, get_root
  * INTEGRITY OR DATA CORRUPTION?
+ * A heap image copied to another address (as when a heap file is mapped
+ * again after a restart) can be reattached: the root block and the data
+ * behind it are intact and the heap keeps working. A damaged image is
+ * rejected.
  *
  * MANIFESTATION OF ERROR:
- *
+ * hl_attach fails on a good image or accepts a bad one, the root is lost,
+ * or allocating from the reattached heap hands out live blocks again.
  */
 int test18()
 {
+    static char heap[HEAP_SIZE * 4], copy[HEAP_SIZE * 4];
+    hl_init(heap, sizeof(heap));
+
+    char *root = hl_alloc(heap, 64);
+    strcpy(root, "root block");
+    hl_set_root(heap, root);
+    srandom(18);
+    for (int i = 0; i < 40; i++)
+    {
+        char *block = hl_alloc(heap, random() % 100);
+        if (i % 3 == 0)
+        {
+            hl_release(heap, block);
+        }
+    }
 
-    return FAILURE;
+    memcpy(copy, heap, sizeof(heap));
+    if (hl_attach(copy, sizeof(copy)) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    char *copy_root = hl_get_root(copy);
+    if (copy_root != copy + (root - heap) || strcmp(copy_root, "root block") != 0)
+    {
+        return FAILURE;
+    }
+    char *block;
+    while ((block = hl_alloc(copy, 24)) != NULL)
+    {
+        memset(block, 0, 24);
+    }
+    if (strcmp(copy_root, "root block") != 0)
+    {
+        return FAILURE;
+    }
+
+    memcpy(copy, heap, sizeof(heap));
+    memset(copy + (root - heap) - 8, 0xff, 8); // smash the root's header
+    return hl_attach(copy, sizeof(copy)) == FAILURE;
 }
 
 /* Stress the heap library and see if you can break it!
  *
- * FUNCTIONS BEING TESTED:
+ * FUNCTIONS BEING TESTED: init_realtime, alloc, release, resize, alloc_aligned
  * INTEGRITY OR DATA CORRUPTION?
+ * Random traffic on a realtime heap keeps every block's contents intact,
+ * and because realtime heaps coalesce on every release, the whole heap is
+ * one block again once everything has been released.
  *
- * MANIFESTATION OF ERROR:
+ * A request bigger than the last first level list covers misses cleanly,
+ * even on a heap that was full of garbage before hl_init_realtime.
  *
+ * MANIFESTATION OF ERROR:
+ * Overlapping blocks show up as changed contents; a block lost from the
+ * TLSF index (or never merged) makes the final large allocation fail; a
+ * crash when the oversized request reads past the TLSF list heads.
  */
 int test19()
 {
+    static char heap[HEAP_SIZE * 32];
+    static char small[HEAP_SIZE * 4 - 8];
+    char *pointers[NPOINTERS];
+    unsigned int sizes[NPOINTERS];
 
-    return FAILURE;
+    if (hl_init_realtime(heap, sizeof(heap)) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    memset(pointers, 0, sizeof(pointers));
+    srandom(19);
+    for (int i = 0; i < 20000; i++)
+    {
+        int index = random() % NPOINTERS;
+        for (unsigned int j = 0; pointers[index] != NULL && j < sizes[index]; j++)
+        {
+            if (pointers[index][j] != (char)index)
+            {
+                return FAILURE;
+            }
+        }
+        unsigned int size = random() % 600;
+        if (pointers[index] == NULL)
+        {
+            pointers[index] = hl_alloc(heap, size);
+        }
+        else if (random() % 2)
+        {
+            char *moved = hl_resize(heap, pointers[index], size);
+            if (moved == NULL)
+            {
+                continue;
+            }
+            pointers[index] = moved;
+        }
+        else
+        {
+            hl_release(heap, pointers[index]);
+            pointers[index] = NULL;
+        }
+        if (pointers[index] != NULL)
+        {
+            sizes[index] = size;
+            memset(pointers[index], index, size);
+        }
+    }
+    for (int i = 0; i < NPOINTERS; i++)
+    {
+        hl_release(heap, pointers[i]);
+    }
+    if (hl_alloc(heap, HEAP_SIZE * 30) == NULL)
+    {
+        return FAILURE;
+    }
+
+    memset(small, 0xa5, sizeof(small));
+    if (hl_init_realtime(small, sizeof(small)) != SUCCESS)
+    {
+        return FAILURE;
+    }
+    return hl_alloc_aligned(small, sizeof(small) - 40, 32) == NULL && hl_alloc(small, 100) != NULL;
 }
 
 /* Stress the heap library and see if you can break it!
  *
- * FUNCTIONS BEING TESTED:
+ * FUNCTIONS BEING TESTED: alloc, release_batch
  * INTEGRITY OR DATA CORRUPTION?
+ * Filling the heap with small and large blocks and releasing them all in
+ * batches (with NULL entries mixed in) gives back every byte, and blocks
+ * still in use keep their contents.
  *
  * MANIFESTATION OF ERROR:
- *
+ * A block skipped or released twice by the batch shows up as changed
+ * contents or as the final large allocation failing.
  */
 int test20()
 {
+    static char heap[HEAP_SIZE * 16];
+    static void *pointers[HEAP_SIZE];
+    unsigned int n = 0;
+
+    hl_init(heap, sizeof(heap));
+    char *kept = hl_alloc(heap, 8);
+    memset(kept, 0x5a, 8);
+    srandom(20);
+    while (n < HEAP_SIZE && (pointers[n] = hl_alloc(heap, random() % 200)) != NULL)
+    {
+        n++;
+    }
+    for (unsigned int i = 0; i < n; i += 3)
+    {
+        hl_release(heap, pointers[i]);
+        pointers[i] = NULL;
+    }
+    for (unsigned int i = 0; i < n; i += 64)
+    {
+        hl_release_batch(heap, &pointers[i], n - i < 64 ? n - i : 64);
+        if (memcmp(kept, "\x5a\x5a\x5a\x5a\x5a\x5a\x5a\x5a", 8) != 0)
+        {
+            return FAILURE;
+        }
+    }
+    hl_release(heap, kept);
+    return hl_alloc(heap, HEAP_SIZE * 15) != NULL;
+}
 
-    return FAILURE;
+/* Blocks the pressure handler of test21 may give back, and how often it
+ * was called.
+ */
+static void *stash[4];
+static int pressure_calls;
+
+int release_stash(void *heap)
+{
+    pressure_calls++;
+    for (int i = 0; i < 4; i++)
+    {
+        hl_release(heap, stash[i]);
+        stash[i] = NULL;
+    }
+    return SUCCESS;
 }
 
 /* Stress the heap library and see if you can break it!
  *
- * FUNCTIONS BEING TESTED:
+ * FUNCTIONS BEING TESTED: alloc, set_pressure_handler
  * INTEGRITY OR DATA CORRUPTION?
+ * When the heap is full, an allocation calls the pressure handler and
+ * succeeds with what the handler released; the handler is not called
+ * while there is room.
  *
  * MANIFESTATION OF ERROR:
- *
+ * The allocation fails although the handler freed enough, or the handler
+ * runs on allocations that fit.
  */
 int test21()
 {
+    static char heap[HEAP_SIZE * 8];
 
-    return FAILURE;
+    hl_init(heap, sizeof(heap));
+    pressure_calls = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        stash[i] = hl_alloc(heap, HEAP_SIZE);
+    }
+    hl_set_pressure_handler(release_stash);
+    void *fits = hl_alloc(heap, HEAP_SIZE);
+    int calls_while_room = pressure_calls;
+    void *needs_stash = hl_alloc(heap, HEAP_SIZE * 3);
+    hl_set_pressure_handler(NULL);
+    return fits != NULL && calls_while_room == 0 && needs_stash != NULL && pressure_calls == 1;
 }
 
 /* Stress the heap library and see if you can break it!
  *
- * FUNCTIONS BEING TESTED:
+ * FUNCTIONS BEING TESTED: good_size, usable_size, expand
  * INTEGRITY OR DATA CORRUPTION?
+ * hl_good_size reports the size hl_alloc gives a block on plain and on
+ * realtime heaps, and blocks asked for at that size come out exactly that
+ * size when the rest of the free block can be split off. hl_expand
+ * grows a block into the free block after it without moving it or
+ * touching its contents, and gives up (changing nothing) when the block
+ * after that is in the way.
  *
  * MANIFESTATION OF ERROR:
- *
+ * Wrong sizes, a moved or changed block, or a failed expand that still
+ * took the free block (so the next allocation of its size fails).
  */
 int test22()
 {
+    static char heap[HEAP_SIZE * 16];
+    static char realtime[HEAP_SIZE * 16];
+
+    hl_init(heap, sizeof(heap));
+    hl_init_realtime(realtime, sizeof(realtime));
+    if (hl_good_size(heap, 1) != 8 || hl_good_size(heap, 8) != 8 || hl_good_size(heap, 9) != 16 ||
+        hl_good_size(heap, 100) != 104 || hl_good_size(realtime, 1) != 16 || hl_good_size(realtime, 17) != 24 ||
+        hl_good_size(realtime, 100) != 104)
+    {
+        return FAILURE;
+    }
+    for (unsigned int size = 1; size < 300; size += 7)
+    {
+        char *block = hl_alloc(heap, hl_good_size(heap, size));
+        char *rt_block = hl_alloc(realtime, hl_good_size(realtime, size));
+        if (hl_usable_size(block) != hl_good_size(heap, size) ||
+            hl_usable_size(rt_block) != hl_good_size(realtime, size))
+        {
+            return FAILURE;
+        }
+        hl_release(heap, block);
+        hl_release(realtime, rt_block);
+    }
+    hl_init(heap, sizeof(heap));
+    char *a = hl_alloc(heap, 300);
+    char *b = hl_alloc(heap, 300);
+    char *c = hl_alloc(heap, 300);
+    memset(a, 'a', 300);
+    memset(c, 'c', 300);
+    hl_release(heap, b);
+    if (hl_expand(heap, a, 1000, 2000) != 0 || hl_alloc(heap, 300) != b)
+    {
+        return FAILURE;
+    }
+    hl_release(heap, b);
+    unsigned int grown = hl_expand(heap, a, 450, 450);
+    if (grown < 450 || grown > 600 || hl_expand(heap, a, 450, 450) != grown)
+    {
+        return FAILURE;
+    }
+    for (int i = 0; i < 300; i++)
+    {
+        if (a[i] != 'a')
+        {
+            return FAILURE;
+        }
+    }
+    memset(a, 'a', grown);
+    hl_release(heap, a);
+    for (int i = 0; i < 300; i++)
+    {
+        if (c[i] != 'c')
+        {
+            return FAILURE;
+        }
+    }
+    return hl_alloc(heap, 600) == a;
+}
 
-    return FAILURE;
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: alloc, usable_size, good_size
+ * INTEGRITY OR DATA CORRUPTION?
+ * Every block holds at least the bytes asked for and at least what
+ * hl_good_size promised, and all of its usable bytes can be written
+ * without touching the next block.
+ *
+ * MANIFESTATION OF ERROR:
+ * A usable size below the request, or writing the whole usable size
+ * corrupting a neighbour.
+ */
+int test23()
+{
+    static char heap[HEAP_SIZE * 32];
+    char *blocks[NPOINTERS];
+
+    hl_init(heap, sizeof(heap));
+    if (hl_usable_size(NULL) != 0)
+    {
+        return FAILURE;
+    }
+    for (int i = 0; i < NPOINTERS; i++)
+    {
+        unsigned int size = i * 3;
+        blocks[i] = hl_alloc(heap, size);
+        if (blocks[i] == NULL || hl_usable_size(blocks[i]) < size || hl_usable_size(blocks[i]) < hl_good_size(heap, size))
+        {
+            return FAILURE;
+        }
+        memset(blocks[i], i, hl_usable_size(blocks[i]));
+    }
+    for (int i = 0; i < NPOINTERS; i++)
+    {
+        for (unsigned int j = 0; j < hl_usable_size(blocks[i]); j++)
+        {
+            if (blocks[i][j] != (char)i)
+            {
+                return FAILURE;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+#define SHARED_PROCESSES 4
+
+/* (HELPER FUNCTION:) Body of a test24 child: joins the heap at its own
+ * address, churns blocks filled with its id, then leaves one block holding
+ * its id behind in its root slot. Returns SUCCESS if every block kept its
+ * contents.
+ */
+int shared_child(const char *name, void *parent_heap, int id)
+{
+    void *heap = hl_shared_open(name, HEAP_SIZE * 64, NULL);
+    if (heap == NULL || heap == parent_heap)
+    {
+        return FAILURE;
+    }
+    unsigned long *slots = hl_get_root(heap);
+    char *blocks[16] = {NULL};
+    unsigned int sizes[16];
+    srandom(id);
+    for (int i = 0; i < 5000; i++)
+    {
+        int index = random() % 16;
+        for (unsigned int j = 0; blocks[index] != NULL && j < sizes[index]; j++)
+        {
+            if (blocks[index][j] != (char)id)
+            {
+                return FAILURE;
+            }
+        }
+        hl_release(heap, blocks[index]);
+        sizes[index] = random() % 300;
+        blocks[index] = hl_alloc(heap, sizes[index]);
+        if (blocks[index] != NULL)
+        {
+            memset(blocks[index], id, sizes[index]);
+        }
+    }
+    char *result = hl_alloc(heap, 32);
+    if (result == NULL)
+    {
+        return FAILURE;
+    }
+    snprintf(result, 32, "child %d", id);
+    slots[id] = hl_shared_offset(heap, result);
+    hl_shared_close(heap, HEAP_SIZE * 64);
+    return SUCCESS;
 }
 
 /* Stress the heap library and see if you can break it!
  *
- * FUNCTIONS BEING TESTED:
+ * FUNCTIONS BEING TESTED: shared_open, init_shared, attach_shared, attach,
+ * alloc, release (across processes)
  * INTEGRITY OR DATA CORRUPTION?
+ * Several processes, each with the heap mapped at its own address, churn
+ * blocks concurrently and pass their results back as offsets. Then a
+ * process is killed while it holds every lock of the heap: the others must
+ * see the heap as broken instead of deadlocking, and hl_attach must repair
+ * it once nobody uses it.
  *
  * MANIFESTATION OF ERROR:
+ * Changed contents or lost results; the test hanging after the kill (the
+ * locks are not robust); allocations still succeeding on a broken heap.
+ */
+int test24()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/hl_test24_%d", (int)getpid());
+    hl_shared_unlink(name);
+    void *heap = hl_shared_open(name, HEAP_SIZE * 64, NULL);
+    if (heap == NULL)
+    {
+        return FAILURE;
+    }
+    volatile unsigned long *slots = hl_alloc(heap, (SHARED_PROCESSES + 1) * sizeof(unsigned long));
+    memset((void *)slots, 0, (SHARED_PROCESSES + 1) * sizeof(unsigned long));
+    hl_set_root(heap, (void *)slots);
+
+    pid_t children[SHARED_PROCESSES];
+    for (int i = 0; i < SHARED_PROCESSES; i++)
+    {
+        if ((children[i] = fork()) == 0)
+        {
+            _exit(shared_child(name, heap, i) == SUCCESS ? 0 : 1);
+        }
+    }
+    int ok = 1;
+    for (int i = 0; i < SHARED_PROCESSES; i++)
+    {
+        int status;
+        waitpid(children[i], &status, 0);
+        char expected[32];
+        snprintf(expected, sizeof(expected), "child %d", i);
+        char *result = hl_shared_pointer(heap, slots[i]);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 && result != NULL &&
+             strcmp(result, expected) == 0;
+        hl_release(heap, result);
+    }
+
+    // consolidating holds every lock nearly all the time, so a kill almost
+    // always lands inside it; retry until one does
+    int broken = 0;
+    for (int attempt = 0; ok && !broken && attempt < 20; attempt++)
+    {
+        slots[SHARED_PROCESSES] = 0;
+        pid_t child = fork();
+        if (child == 0)
+        {
+            for (;;)
+            {
+                hl_consolidate(heap);
+                slots[SHARED_PROCESSES] = 1;
+            }
+        }
+        while (slots[SHARED_PROCESSES] == 0)
+        {
+            usleep(100);
+        }
+        usleep(1000);
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+        broken = hl_attach_shared(heap, HEAP_SIZE * 64) != SUCCESS;
+        void *block = hl_alloc(heap, 100);
+        ok = broken ? block == NULL && hl_alloc(heap, 8) == NULL : block != NULL;
+        hl_release(heap, block);
+    }
+    ok = ok && broken && hl_attach(heap, HEAP_SIZE * 64) == SUCCESS && hl_alloc(heap, 100) != NULL &&
+         hl_attach_shared(heap, HEAP_SIZE * 64) == SUCCESS;
+    hl_shared_close(heap, HEAP_SIZE * 64);
+    hl_shared_unlink(name);
+    return ok;
+}
+
+/* Set by the reader of test25: 1 once inside its critical section, 2 once
+ * it has left. Set to 1 by the test to let it leave.
+ */
+static volatile int reader_inside;
+static volatile int reader_may_leave;
+
+/* Enters a critical section and stays in it until told to leave. */
+void *epoch_reader_thread(void *ptr)
+{
+    (void)ptr;
+    if (hl_epoch_enter() != SUCCESS)
+    {
+        return NULL;
+    }
+    __atomic_store_n(&reader_inside, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&reader_may_leave, __ATOMIC_SEQ_CST))
+    {
+        usleep(100);
+    }
+    hl_epoch_exit();
+    __atomic_store_n(&reader_inside, 2, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/* Allocates blocks, retires them from inside critical sections and
+ * flushes before exiting, so its blocks are all released by the time it
+ * is joined.
+ */
+void *epoch_retire_thread(void *ptr)
+{
+    void *heap = ptr;
+    for (int i = 0; i < 2000; i++)
+    {
+        char *block;
+        while ((block = hl_alloc(heap, 48)) == NULL)
+        {
+            hl_epoch_flush();
+        }
+        memset(block, i, 48);
+        hl_epoch_enter();
+        if (hl_retire(heap, block) != SUCCESS)
+        {
+            hl_release(heap, block);
+        }
+        hl_epoch_exit();
+    }
+    hl_epoch_flush();
+    return NULL;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: epoch_enter, epoch_exit, retire, epoch_flush
+ * (threaded)
+ * INTEGRITY OR DATA CORRUPTION?
+ * Threads retire blocks from inside critical sections and flush. Then,
+ * while a reader sits in a critical section, the test retires a block and
+ * plenty more to drive reclamation: none of them may be released (the
+ * heap must not hand any of them out, nor write into them) until the
+ * reader leaves. After that hl_epoch_flush gives the whole heap back.
  *
+ * MANIFESTATION OF ERROR:
+ * A retired block handed out again or overwritten while the reader could
+ * still see it, or blocks never coming back after the flush.
  */
-int test23()
+int test25()
 {
+    static char heap[HEAP_SIZE * 64];
+    static char *retired[200];
+    static char *filled[HEAP_SIZE];
+    int n_threads = 4;
+    pthread_t threads[n_threads];
 
-    return FAILURE;
+    hl_init(heap, sizeof(heap));
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_create(&threads[i], NULL, epoch_retire_thread, heap);
+    }
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_t reader;
+    reader_inside = 0;
+    reader_may_leave = 0;
+    pthread_create(&reader, NULL, epoch_reader_thread, NULL);
+    while (__atomic_load_n(&reader_inside, __ATOMIC_SEQ_CST) == 0)
+    {
+        usleep(100);
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        retired[i] = hl_alloc(heap, 100);
+        memset(retired[i], 0x3c, 100);
+        hl_retire(heap, retired[i]);
+    }
+    int ok = 1;
+    int n_filled = 0;
+    while (n_filled < HEAP_SIZE && (filled[n_filled] = hl_alloc(heap, 100)) != NULL)
+    {
+        for (int i = 0; i < 200; i++)
+        {
+            ok = ok && filled[n_filled] != retired[i];
+        }
+        n_filled++;
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        for (int j = 0; j < 100; j++)
+        {
+            ok = ok && retired[i][j] == 0x3c;
+        }
+    }
+    __atomic_store_n(&reader_may_leave, 1, __ATOMIC_SEQ_CST);
+    pthread_join(reader, NULL);
+
+    for (int i = 0; i < n_filled; i++)
+    {
+        hl_release(heap, filled[i]);
+    }
+    hl_epoch_flush();
+    return ok && reader_inside == 2 && hl_alloc(heap, HEAP_SIZE * 60) != NULL;
+}
+
+/* Objects of the test26 cache, and how often they were constructed and
+ * destroyed.
+ */
+typedef struct
+{
+    int constructed;
+    int uses;
+    char payload[32];
+} cached_object;
+
+static int ctor_calls;
+static int dtor_calls;
+
+void construct_object(void *ptr)
+{
+    cached_object *object = (cached_object *)ptr;
+    object->constructed = 1;
+    object->uses = 0;
+    ctor_calls++;
+}
+
+void destroy_object(void *ptr)
+{
+    cached_object *object = (cached_object *)ptr;
+    dtor_calls += object->constructed;
+    object->constructed = 0;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: cache_create, cache_alloc, cache_free,
+ * cache_reap, cache_reclaim, set_pressure_handler
+ * INTEGRITY OR DATA CORRUPTION?
+ * Objects come back aligned and constructed; freeing and allocating them
+ * again keeps their state and runs no constructor. Reaping destroys every
+ * constructed object once. With hl_cache_install_reclaim, an allocation
+ * on a heap that is full apart from empty slabs succeeds, and the pressure
+ * handler installed before is still called once the caches are empty.
+ *
+ * MANIFESTATION OF ERROR:
+ * Misaligned or duplicate objects, constructors run again (or state lost)
+ * on reuse, destructors missed or run twice, the allocation failing
+ * although the cache held free slabs, or the previous handler replaced
+ * (not called, or called although the caches had room).
+ */
+int test26()
+{
+    static char heap[HEAP_SIZE * 64];
+    static void *fill[HEAP_SIZE];
+    cached_object *objects[20];
+
+    hl_init(heap, sizeof(heap));
+    ctor_calls = 0;
+    dtor_calls = 0;
+    hl_cache_t *cache = hl_cache_create(heap, sizeof(cached_object), 64, construct_object, destroy_object);
+    if (cache == NULL)
+    {
+        return FAILURE;
+    }
+    int ok = 1;
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            objects[i] = hl_cache_alloc(cache);
+            ok = ok && objects[i] != NULL && (uintptr_t)objects[i] % 64 == 0 &&
+                 objects[i]->constructed && objects[i]->uses <= round;
+            for (int j = 0; ok && j < i; j++)
+            {
+                ok = objects[j] != objects[i];
+            }
+        }
+        int constructed = ctor_calls;
+        for (int i = 0; ok && i < 20; i++)
+        {
+            objects[i]->uses++;
+            hl_cache_free(cache, objects[i]);
+        }
+        ok = ok && constructed >= 20 && (round == 0 || ctor_calls == constructed);
+    }
+    ok = ok && hl_cache_reap(cache) > 0 && dtor_calls == ctor_calls && hl_cache_reap(cache) == 0;
+
+    // leave the cache holding empty slabs, then fill the rest of the heap
+    for (int i = 0; i < 20; i++)
+    {
+        objects[i] = hl_cache_alloc(cache);
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        hl_cache_free(cache, objects[i]);
+    }
+    int n = 0;
+    while (n < HEAP_SIZE && (fill[n] = hl_alloc(heap, 256)) != NULL)
+    {
+        n++;
+    }
+    pressure_calls = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        stash[i] = NULL;
+    }
+    hl_set_pressure_handler(release_stash);
+    hl_pressure_handler_t previous = hl_cache_install_reclaim();
+    ok = ok && previous == release_stash && hl_cache_install_reclaim() == release_stash;
+    void *reclaimed = hl_alloc(heap, 256);
+    int calls_while_cached = pressure_calls;
+    void *nothing_cached = hl_alloc(heap, HEAP_SIZE * 2);
+    ok = ok && hl_set_pressure_handler(previous) != release_stash;
+    hl_set_pressure_handler(NULL);
+    ok = ok && reclaimed != NULL && dtor_calls == ctor_calls && calls_while_cached == 0 &&
+         nothing_cached == NULL && pressure_calls == 1;
+
+    hl_release(heap, reclaimed);
+    for (int i = 0; i < n; i++)
+    {
+        hl_release(heap, fill[i]);
+    }
+    hl_cache_destroy(cache);
+    return ok;
+}
+
+/* (HELPER FUNCTION:) Dumps the heap profile and counts the lines for live
+ * blocks of size bytes. Returns -1 if the header line is not "heap_v2"
+ * with objects live blocks of bytes bytes in total.
+ */
+int count_profile_lines(unsigned long objects, unsigned long bytes, unsigned int size)
+{
+    char line[1024], expected[128];
+    FILE *out = tmpfile();
+    if (out == NULL || hl_profile_dump(out) != SUCCESS)
+    {
+        return -1;
+    }
+    rewind(out);
+    snprintf(expected, sizeof(expected), "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/1\n",
+             objects, bytes, objects, bytes);
+    if (fgets(line, sizeof(line), out) == NULL || strcmp(line, expected) != 0)
+    {
+        fclose(out);
+        return -1;
+    }
+    int count = 0;
+    snprintf(expected, sizeof(expected), "1: %u [1: %u] @ 0x", size, size);
+    while (fgets(line, sizeof(line), out) != NULL)
+    {
+        count += strncmp(line, expected, strlen(expected)) == 0;
+    }
+    fclose(out);
+    return count;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: profile_start, profile_dump, alloc, release
+ * INTEGRITY OR DATA CORRUPTION?
+ * With a 1 byte sampling interval every allocation is sampled, so the dump
+ * lists each live block with its size and a stack; once they are released
+ * the dump is empty again. Blocks of shared heaps are never sampled.
+ *
+ * MANIFESTATION OF ERROR:
+ * A wrong "heap_v2" header, missing or extra block lines, released blocks
+ * still listed (hl_release not telling the profiler), or blocks of the
+ * shared heap listed.
+ */
+int test27()
+{
+    static char heap[HEAP_SIZE * 8];
+    static char shared[HEAP_SIZE * 4];
+    char *blocks[6];
+
+    hl_init(heap, sizeof(heap));
+    hl_init_shared(shared, sizeof(shared));
+    hl_profile_start(1);
+    for (int i = 0; i < 6; i++)
+    {
+        blocks[i] = hl_alloc(heap, i % 2 == 0 ? 100 : 300);
+    }
+    char *unsampled = hl_alloc(shared, 200);
+    int small = count_profile_lines(6, 1200, 100);
+    int large = count_profile_lines(6, 1200, 300);
+    hl_release(shared, unsampled);
+    for (int i = 0; i < 6; i++)
+    {
+        hl_release(heap, blocks[i]);
+    }
+    int after = count_profile_lines(0, 0, 100);
+    hl_profile_stop();
+    return small == 3 && large == 3 && after == 0;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: persist_open, persist_close, set_root, get_root
+ * INTEGRITY OR DATA CORRUPTION?
+ * A heap file can be opened again right after hl_persist_close, by the same
+ * process, and comes back with its root block; while it is open a second
+ * open is refused. Reopening with size 0 reports the size of the file,
+ * and reopening with the wrong size is refused.
+ *
+ * MANIFESTATION OF ERROR:
+ * The reopen fails (the lock outlived the close), the second open succeeds
+ * while the heap is in use, the reported size is wrong, or the root or its
+ * contents are lost.
+ */
+int test28()
+{
+    char path[] = "/tmp/hl_test28_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return FAILURE;
+    }
+    close(fd);
+
+    int created = 0;
+    unsigned int heap_size = HEAP_SIZE * 4;
+    void *heap = hl_persist_open(path, &heap_size, &created);
+    if (heap == NULL || !created || heap_size != HEAP_SIZE * 4)
+    {
+        unlink(path);
+        return FAILURE;
+    }
+    char *root = hl_alloc(heap, 64);
+    strcpy(root, "persisted root");
+    hl_set_root(heap, root);
+    int refused = hl_persist_open(path, &heap_size, NULL) == NULL;
+    hl_persist_close(heap, heap_size);
+
+    unsigned int wrong_size = HEAP_SIZE * 8;
+    int ok = refused && hl_persist_open(path, &wrong_size, NULL) == NULL && wrong_size == HEAP_SIZE * 8;
+    for (int i = 0; ok && i < 2; i++)
+    {
+        heap_size = 0;
+        heap = hl_persist_open(path, &heap_size, &created);
+        ok = heap != NULL && !created && heap_size == HEAP_SIZE * 4 && hl_get_root(heap) != NULL &&
+             strcmp(hl_get_root(heap), "persisted root") == 0 && hl_persist_sync(heap, heap_size) == SUCCESS;
+        if (heap != NULL)
+        {
+            hl_persist_close(heap, heap_size);
+        }
+    }
+    unlink(path);
+    return ok;
+}
+
+typedef struct
+{
+    int id;
+    void *heap;
+    hl_async_t *async;
+    int ok;
+} async_args;
+
+/* Allocates blocks one at a time, checks each one's contents and hands it
+ * to the reclaimer. The queues are far smaller than the number of blocks,
+ * so this keeps running into a full queue.
+ */
+void *async_release_thread(void *ptr)
+{
+    async_args *args = (async_args *)ptr;
+    args->ok = 1;
+    for (int i = 0; i < 2000; i++)
+    {
+        unsigned int size = 16 + (i * 37 + args->id) % 200;
+        char *block = hl_alloc(args->heap, size);
+        if (block == NULL)
+        {
+            args->ok = 0;
+            return NULL;
+        }
+        memset(block, args->id, size);
+        for (unsigned int j = 0; j < size; j++)
+        {
+            if (block[j] != (char)args->id)
+            {
+                args->ok = 0;
+            }
+        }
+        hl_release_async(args->async, block);
+    }
+    return NULL;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: async_start, release_async, async_flush,
+ * async_stop (threaded)
+ * INTEGRITY OR DATA CORRUPTION?
+ * Waves of short-lived threads allocate and release asynchronously
+ * through 8 entry queues. Backpressure must keep the blocks in flight
+ * bounded, so the heap never runs out. hl_async_flush must return only
+ * once everything queued is released, and hl_async_stop must release
+ * whatever is still queued.
+ *
+ * MANIFESTATION OF ERROR:
+ * An allocation failing (blocks lost from an overrun queue or never
+ * released), a block handed out twice (changed contents), or the heap not
+ * empty after a flush or a stop.
+ */
+int test29()
+{
+    static char heap[HEAP_SIZE * 64];
+    int n_threads = 4;
+    pthread_t threads[n_threads];
+    async_args args[n_threads];
+
+    hl_init(heap, sizeof(heap));
+    hl_async_t *async = hl_async_start(heap, 8);
+    if (async == NULL)
+    {
+        return FAILURE;
+    }
+    int ok = 1;
+    for (int wave = 0; wave < 3; wave++)
+    {
+        for (int i = 0; i < n_threads; i++)
+        {
+            args[i] = (async_args){.id = wave * n_threads + i + 1, .heap = heap, .async = async, .ok = 0};
+            pthread_create(&threads[i], NULL, async_release_thread, (void *)&args[i]);
+        }
+        for (int i = 0; i < n_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+            ok = ok && args[i].ok;
+        }
+    }
+
+    void *blocks[6];
+    for (int i = 0; i < 6; i++)
+    {
+        blocks[i] = hl_alloc(heap, HEAP_SIZE * 8);
+        hl_release_async(async, blocks[i]);
+    }
+    hl_async_flush(async);
+    void *whole = hl_alloc(heap, HEAP_SIZE * 60);
+    ok = ok && whole != NULL;
+    hl_release_async(async, whole);
+    hl_async_stop(async);
+    return ok && hl_alloc(heap, HEAP_SIZE * 60) != NULL;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: tenant_register, tenant_unregister,
+ * tenant_alloc, tenant_resize, tenant_expand, tenant_free,
+ * tenant_heap_of, tenant_usage
+ * INTEGRITY OR DATA CORRUPTION?
+ * Two heaps back to back are told apart at their boundary, and addresses
+ * past the last one belong to no heap. Overlapping heaps are rejected.
+ * Allocations stop at the quota, not at the end of the heap, and start
+ * again once something is freed. Resizing and expanding a block are
+ * charged, so freeing it brings usage back to 0. An unregistered heap is
+ * forgotten and can be registered again.
+ *
+ * MANIFESTATION OF ERROR:
+ * A wrong heap (or none) for an address, an overlapping heap accepted,
+ * usage over the quota or left over after every block is freed (or
+ * wrapped around below 0), or a heap that cannot be registered again.
+ */
+int test30()
+{
+    static char heaps[HEAP_SIZE * 48];
+    static void *blocks[HEAP_SIZE];
+    unsigned int heap_size = HEAP_SIZE * 16;
+    unsigned long quota = 2048;
+    char *first = heaps;
+    char *second = heaps + heap_size;
+
+    hl_init(first, heap_size);
+    hl_init(second, heap_size);
+    if (hl_tenant_register(first, heap_size, quota) == FAILURE ||
+        hl_tenant_register(second, heap_size, 0) == FAILURE)
+    {
+        return FAILURE;
+    }
+    int ok = hl_tenant_register(first + heap_size / 2, heap_size, 0) == FAILURE &&
+             hl_tenant_register(first, 0, 0) == FAILURE;
+    ok = ok && hl_tenant_heap_of(first + heap_size / 2) == first &&
+         hl_tenant_heap_of(first + heap_size - 1) == first &&
+         hl_tenant_heap_of(second) == second &&
+         hl_tenant_heap_of(second + heap_size - 1) == second &&
+         hl_tenant_heap_of(second + heap_size) == NULL;
+
+    // fill the first tenant up to its quota
+    int n = 0;
+    while (n < HEAP_SIZE && (blocks[n] = hl_tenant_alloc(first, 100)) != NULL)
+    {
+        ok = ok && hl_tenant_heap_of(blocks[n]) == first;
+        n++;
+    }
+    unsigned long used = hl_tenant_usage(first);
+    ok = ok && n > 0 && used <= quota + 24 && used + hl_good_size(first, 100) > quota;
+    ok = ok && hl_tenant_resize(first, blocks[0], 1000) == NULL &&
+         hl_tenant_expand(first, blocks[0], 1000, 1000) == 0 &&
+         hl_tenant_usage(first) == used;
+    hl_tenant_free(blocks[--n]);
+    ok = ok && (blocks[n] = hl_tenant_alloc(first, 100)) != NULL;
+    for (int i = 0; i <= n; i++)
+    {
+        hl_tenant_free(blocks[i]);
+    }
+    ok = ok && hl_tenant_usage(first) == 0;
+
+    // growth is charged, so freeing the grown block credits what it holds
+    void *block = hl_tenant_alloc(second, 100);
+    ok = ok && block != NULL && hl_tenant_expand(second, block, 1000, 1000) != 0 &&
+         hl_tenant_usage(second) == hl_usable_size(block);
+    block = hl_tenant_resize(second, block, 2000);
+    ok = ok && block != NULL && hl_tenant_usage(second) == hl_usable_size(block);
+    block = hl_tenant_resize(second, block, 50);
+    ok = ok && block != NULL && hl_tenant_usage(second) == hl_usable_size(block);
+    hl_tenant_free(block);
+    ok = ok && hl_tenant_usage(second) == 0;
+
+    hl_tenant_unregister(first);
+    ok = ok && hl_tenant_heap_of(first + 1) == NULL && hl_tenant_alloc(first, 100) == NULL &&
+         hl_tenant_heap_of(second) == second;
+    ok = ok && hl_tenant_register(first, heap_size, 0) == SUCCESS &&
+         hl_tenant_heap_of(first + heap_size - 1) == first && hl_tenant_usage(first) == 0 &&
+         (block = hl_tenant_alloc(first, 100)) != NULL;
+    hl_tenant_free(block);
+    hl_tenant_unregister(first);
+    hl_tenant_unregister(second);
+    return ok;
 }
@@ -0,0 +1,234 @@
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <vector>
+#include "hl_pmr.hpp"
+
+/*
+ * Tests for the C++ adapters in hl_pmr.hpp. tests.c is C, so these build on
+ * their own:
+ *
+ *   gcc -c heaplib.c spinlock.c
+ *   g++ -std=c++17 -o tests_pmr tests_pmr.cpp heaplib.o spinlock.o -lpthread
+ *
+ * Each test returns SUCCESS or FAILURE; the program exits nonzero if any
+ * test fails.
+ */
+
+#define HEAP_SIZE 1024
+
+/* (HELPER FUNCTION:) Returns true if block lies inside heap. */
+static bool inside(const void *heap, unsigned int heap_size, const void *block)
+{
+    const char *start = static_cast<const char *>(heap);
+    const char *address = static_cast<const char *>(block);
+    return address >= start && address < start + heap_size;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: heap_resource::allocate, deallocate
+ * INTEGRITY OR DATA CORRUPTION?
+ * Every power of two alignment up to 4 KiB is honored, the blocks come from
+ * the heap, and once they are all deallocated the heap is whole again.
+ *
+ * MANIFESTATION OF ERROR:
+ * A misaligned block, a block from somewhere else, or the final large
+ * allocation failing (a block or gap not given back).
+ */
+static int test_resource_alignment()
+{
+    alignas(8) static char heap[HEAP_SIZE * 64];
+    void *blocks[10];
+
+    hl_init(heap, sizeof(heap));
+    hl::heap_resource resource(heap);
+    for (int i = 0; i < 10; i++)
+    {
+        std::size_t alignment = std::size_t(8) << i;
+        blocks[i] = resource.allocate(100 + i, alignment);
+        if (reinterpret_cast<std::uintptr_t>(blocks[i]) % alignment != 0 ||
+            !inside(heap, sizeof(heap), blocks[i]))
+        {
+            return FAILURE;
+        }
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        resource.deallocate(blocks[i], 100 + i, std::size_t(8) << i);
+    }
+    return hl_alloc(heap, HEAP_SIZE * 60) != NULL;
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: heap_resource::allocate, heap_allocator::allocate
+ * INTEGRITY OR DATA CORRUPTION?
+ * Requests the heap cannot satisfy (too big for the heap, too big for an
+ * unsigned int, or an alignment the heap has no room for) throw
+ * std::bad_alloc, and a container that outgrows the heap throws it too
+ * while keeping its contents.
+ *
+ * MANIFESTATION OF ERROR:
+ * No exception (a NULL or bogus block handed out), a crash, or a container
+ * that lost its elements.
+ */
+static int test_bad_alloc()
+{
+    alignas(8) static char heap[HEAP_SIZE * 8];
+
+    hl_init(heap, sizeof(heap));
+    hl::heap_resource resource(heap);
+    const std::size_t requests[][2] = {
+        {HEAP_SIZE * 8, 8},
+        {std::size_t(UINT_MAX) + 1, 8},
+        {HEAP_SIZE * 4, HEAP_SIZE * 4},
+    };
+    for (const auto &request : requests)
+    {
+        try
+        {
+            void *block = resource.allocate(request[0], request[1]);
+            (void)block;
+            return FAILURE;
+        }
+        catch (const std::bad_alloc &)
+        {
+        }
+    }
+
+    std::vector<int, hl::heap_allocator<int>> numbers{hl::heap_allocator<int>(heap)};
+    try
+    {
+        for (int i = 0;; i++)
+        {
+            numbers.push_back(i);
+        }
+    }
+    catch (const std::bad_alloc &)
+    {
+    }
+    for (std::size_t i = 0; i < numbers.size(); i++)
+    {
+        if (numbers[i] != static_cast<int>(i))
+        {
+            return FAILURE;
+        }
+    }
+    return !numbers.empty();
+}
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: heap_resource::is_equal
+ * INTEGRITY OR DATA CORRUPTION?
+ * Resources over the same heap compare equal (so pmr containers may move
+ * blocks between them), resources over different heaps and other kinds of
+ * resource do not.
+ *
+ * MANIFESTATION OF ERROR:
+ * A block released to a heap it was not allocated from.
+ */
+static int test_resource_equality()
+{
+    alignas(8) static char heap[HEAP_SIZE * 4];
+    alignas(8) static char other_heap[HEAP_SIZE * 4];
+
+    hl_init(heap, sizeof(heap));
+    hl_init(other_heap, sizeof(other_heap));
+    hl::heap_resource resource(heap);
+    hl::heap_resource same(heap);
+    hl::heap_resource other(other_heap);
+    std::pmr::monotonic_buffer_resource arena(&resource);
+    return resource.is_equal(same) && same.is_equal(resource) && resource == same &&
+           !resource.is_equal(other) && resource != other &&
+           !resource.is_equal(*std::pmr::new_delete_resource()) &&
+           !resource.is_equal(arena) && !arena.is_equal(resource);
+}
+
+/* An over-aligned element type, to take heap_allocator through
+ * hl_alloc_aligned.
+ */
+struct alignas(64) wide
+{
+    int value;
+};
+
+/* Stress the heap library and see if you can break it!
+ *
+ * FUNCTIONS BEING TESTED: heap_allocator (rebind, ==, allocate)
+ * INTEGRITY OR DATA CORRUPTION?
+ * Allocators rebound to another type (as std::list does for its nodes)
+ * keep the heap and compare equal to the original; allocators over
+ * different heaps do not. Over-aligned elements are aligned, and every
+ * node comes from the allocator's heap.
+ *
+ * MANIFESTATION OF ERROR:
+ * A rebound allocator that lost its heap or compares wrong, misaligned
+ * elements, or nodes outside the heap.
+ */
+static int test_allocator_rebind()
+{
+    alignas(8) static char heap[HEAP_SIZE * 32];
+    alignas(8) static char other_heap[HEAP_SIZE * 4];
+
+    hl_init(heap, sizeof(heap));
+    hl_init(other_heap, sizeof(other_heap));
+    hl::heap_allocator<int> ints(heap);
+    using rebound = std::allocator_traits<hl::heap_allocator<int>>::rebind_alloc<double>;
+    rebound doubles(ints);
+    if (doubles.heap() != heap || !(doubles == ints) || doubles != ints ||
+        ints == hl::heap_allocator<int>(other_heap))
+    {
+        return FAILURE;
+    }
+
+    std::list<int, hl::heap_allocator<int>> list(ints);
+    for (int i = 0; i < 100; i++)
+    {
+        list.push_back(i);
+    }
+    for (const int &value : list)
+    {
+        if (!inside(heap, sizeof(heap), &value))
+        {
+            return FAILURE;
+        }
+    }
+
+    std::vector<wide, hl::heap_allocator<wide>> wides{hl::heap_allocator<wide>(heap)};
+    for (int i = 0; i < 50; i++)
+    {
+        wides.push_back(wide{i});
+        if (reinterpret_cast<std::uintptr_t>(wides.data()) % alignof(wide) != 0)
+        {
+            return FAILURE;
+        }
+    }
+    return list.get_allocator() == ints && inside(heap, sizeof(heap), wides.data());
+}
+
+int main()
+{
+    struct
+    {
+        int (*run)();
+        const char *description;
+    } tests[] = {
+        {test_resource_alignment, "heap_resource honors every alignment and gives the heap back"},
+        {test_bad_alloc, "requests the heap cannot satisfy throw bad_alloc"},
+        {test_resource_equality, "heap_resources are equal exactly when they share a heap"},
+        {test_allocator_rebind, "heap_allocator keeps its heap when rebound and aligns wide types"},
+    };
+    int failed = 0;
+    for (const auto &test : tests)
+    {
+        int ok = test.run();
+        failed += !ok;
+        std::printf("%s : %s\n", ok ? "PASS" : "FAIL", test.description);
+    }
+    return failed == 0 ? 0 : 1;
+}